@@ -0,0 +1,21 @@
+#pragma once
+#include <cstdint>
+
+// Loops over a whole leaf at once. Each kernel has AVX-512, AVX2 and scalar versions
+// and picks the widest one the CPU supports the first time it is called.
+namespace quadtree::kernels {
+	// Squared distance from (qx, qy) to the point of every id. The coordinates of id are
+	// x[id * stride] and y[id * stride], so this works for separate arrays (stride 1)
+	// as well as interleaved pairs (stride 2)
+	void squaredDistances(float qx, float qy, const float *x, const float *y, int stride,
+			const uint32_t *ids, int n, float *out);
+
+	// Add the pull of n masses at (x[i], y[i]) on a body at (px, py) to (ax, ay), without the
+	// gravitational constant. softening is added to every squared distance and masses at
+	// exactly the position of the body are skipped
+	void gravity(float px, float py, const float *x, const float *y, const float *m, int n,
+			float softening, float &ax, float &ay);
+
+	// Name of the instruction set the kernels dispatch to
+	const char *instructionSet();
+}
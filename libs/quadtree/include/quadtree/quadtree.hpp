@@ -1,16 +1,33 @@
 #pragma once
 #include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
 #include <map>
-#include <unordered_set>
 #include <vector>
 #include <math.h>
-#include <queue>
+#include <type_traits>
 #include <iostream>
-#include <unordered_map>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "kernels.hpp"
 
 namespace quadtree {
+	using pairf = std::pair<float, float>;
+
+	// Runtime reducer made of function pointers. The tree calls its reducer as
+	// reducer.distance(a, b) and so on, so any type with members of the same names can be
+	// used instead, see PointReducer. Those calls can be inlined, calls through this can't
 	template <class Data, class Bounds>
 	struct TreeReducer {
+		// Every method has to be given, so reducers written before mass and position were
+		// added fail to build instead of leaving them null
+		TreeReducer(float (*distance)(const Data &, const Data &), bool (*inBounds)(const Data &, const Bounds &),
+				float (*minDistance)(const Data &, const Bounds &), Bounds (*getBounds)(const Bounds &, int),
+				float (*mass)(const Data &), pairf (*position)(const Data &))
+			: distance(distance), inBounds(inBounds), minDistance(minDistance), getBounds(getBounds), mass(mass), position(position) {}
+
 		// Calculate the distance between two pieces of data
 		float (*distance)(const Data &a, const Data &b);
 		// Check if data is within a given bounding box
@@ -19,104 +36,370 @@ namespace quadtree {
 		float (*minDistance)(const Data &data, const Bounds &bounds);
 		// Get the bounding box of a section based on its parent
 		Bounds (*getBounds)(const Bounds &parent, int i);
+		// Get the mass of a piece of data, used for the aggregates stored on every node
+		float (*mass)(const Data &data);
+		// Get the position of a piece of data, used for the center of mass of every node
+		pairf (*position)(const Data &data);
 	};
 
-	using pairf = std::pair<float, float>;
-
 	// Default tree reducer methods
 	float distance(const pairf &a, const pairf &b);
 	bool inBounds(const pairf &data, const std::pair<pairf, pairf> &bounds);
 	float minDistance(const pairf &data, const std::pair<pairf, pairf> &bounds);
 	std::pair<pairf, pairf> getBounds(const std::pair<pairf, pairf> &data, int i);
+	float mass(const pairf &data);
+	pairf position(const pairf &data);
+
+	// Compile time version of the default reducer methods
+	struct PointReducer {
+		static float distance(const pairf &a, const pairf &b) {
+			return (a.first - b.first) * (a.first - b.first) + (a.second - b.second) * (a.second - b.second);
+		}
+
+		static bool inBounds(const pairf &data, const std::pair<pairf, pairf> &bounds) {
+			return data.first >= bounds.first.first && data.second >= bounds.first.second
+				&& data.first <= bounds.second.first && data.second <= bounds.second.second;
+		}
+
+		static float minDistance(const pairf &point, const std::pair<pairf, pairf> &bounds) {
+			// Find the closest point and return the distance
+			pairf closestPoint(
+				std::min(std::max(point.first, bounds.first.first), bounds.second.first),
+				std::min(std::max(point.second, bounds.first.second), bounds.second.second)
+			);
+			return distance(point, closestPoint);
+		}
+
+		// Return the bounding box of child node i
+		static std::pair<pairf, pairf> getBounds(const std::pair<pairf, pairf> &data, int i) {
+			pairf size((data.second.first - data.first.first) / 2.f, (data.second.second - data.first.second) / 2.f);
+			pairf start(size.first * (float)(i & 1) + data.first.first, size.second * (float)((i >> 1) & 1) + data.first.second);
+			return { { start.first, start.second }, { start.first + size.first, start.second + size.second } };
+		}
+
+		// Every point has the same weight
+		static float mass(const pairf &data) {
+			return 1.f;
+		}
+
+		static pairf position(const pairf &data) {
+			return data;
+		}
+
+		// Distance from a to the data with each id, used for whole leaves at once
+		static void distances(const pairf &a, const pairf *elements, const uint32_t *ids, int n, float *out) {
+			static_assert(sizeof(pairf) == 2 * sizeof(float), "points are read as interleaved floats");
+			kernels::squaredDistances(a.first, a.second, &elements->first, &elements->second, 2, ids, n, out);
+		}
+	};
+
+	// Reducers may optionally have a batched distances(obj, elements, ids, n, out) method
+	template<class Reducer, class Data, class = void>
+	struct hasDistances : std::false_type {};
+	template<class Reducer, class Data>
+	struct hasDistances<Reducer, Data, std::void_t<decltype(std::declval<const Reducer &>().distances(
+		std::declval<const Data &>(), std::declval<const Data *>(), std::declval<const uint32_t *>(), 0, std::declval<float *>()))>>
+		: std::true_type {};
+
+	// Reducer used when none is given to a tree. Policies are default constructed and
+	// function pointer reducers use the default methods above
+	template<class Reducer>
+	Reducer defaultReducer() {
+		return Reducer();
+	}
+	template<>
+	inline TreeReducer<pairf, std::pair<pairf, pairf>> defaultReducer() {
+		return TreeReducer<pairf, std::pair<pairf, pairf>>(distance, inBounds, minDistance, getBounds, mass, position);
+	}
+
+	// Index of the calling thread and the number of threads available to parallel regions.
+	// Without OpenMP everything runs on a single thread
+	inline int threadIndex() {
+#ifdef _OPENMP
+		return omp_get_thread_num();
+#else
+		return 0;
+#endif
+	}
+	inline int threadCount() {
+#ifdef _OPENMP
+		return omp_get_max_threads();
+#else
+		return 1;
+#endif
+	}
+
+	// Number of levels that can be distinguished by a Morton code
+	constexpr int mortonDepth = 16;
+	// Interleave the bits of a position quantized to a 2^mortonDepth grid over bounds.
+	// The two bits for each level match the child index used by getBounds
+	uint32_t mortonCode(const pairf &position, const std::pair<pairf, pairf> &bounds);
+	// Sort keys by their upper 32 bits with a radix sort. scratch is used as the second buffer
+	void sortByCode(std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch);
+
+	// Allocates nodes in blocks of sections siblings so the children of a node are contiguous.
+	// Blocks are carved out of large slabs and released blocks are kept on a free list,
+	// so splitting and merging nodes doesn't touch the global heap once the pool is warm.
+	template<class Node, unsigned int sections>
+	class NodePool {
+	public:
+		static constexpr int blocksPerSlab = 1024;
+
+		Node* allocate() {
+			if (freeBlocks.size()) {
+				Node* block = freeBlocks.back();
+				freeBlocks.pop_back();
+				return block;
+			}
+			if (slab == slabs.size() || used == blocksPerSlab) {
+				if (slab < slabs.size()) slab++;
+				if (slab == slabs.size()) slabs.emplace_back(new Node[blocksPerSlab * sections]);
+				used = 0;
+			}
+			return &slabs[slab][sections * used++];
+		}
+
+		void release(Node* block) {
+			freeBlocks.push_back(block);
+		}
+
+		// Hand some free blocks to another pool so they can be reused there
+		void share(NodePool &other, size_t count) {
+			count = std::min(count, freeBlocks.size());
+			other.freeBlocks.insert(other.freeBlocks.end(), freeBlocks.end() - count, freeBlocks.end());
+			freeBlocks.resize(freeBlocks.size() - count);
+		}
+
+		size_t freeCount() const {
+			return freeBlocks.size();
+		}
+
+		// Release every block at once. Slabs are kept for reuse
+		void clear() {
+			freeBlocks.clear();
+			slab = 0;
+			used = 0;
+		}
+
+	private:
+		std::vector<std::unique_ptr<Node[]>> slabs;
+		std::vector<Node*> freeBlocks;
+		size_t slab = 0;
+		int used = 0;
+	};
 
 	template<class Data, class Bounds, unsigned int sections>
 	struct TreeNode {
-		std::unordered_set<Data*> values;
+		// Ids of the data stored in a leaf. Leaves reserve binSize slots up front and
+		// only grow past that at the maximum depth
+		std::vector<uint32_t> values;
 		int leafCount = 0;
-		TreeReducer<Data, Bounds> *reducer;
+		int depth = 0;
 
 		Bounds bounds;
 
 		bool container = false;
-		std::array<TreeNode*, sections> children;
-		TreeNode* parent;
+		// First of sections contiguous siblings allocated from the tree's pool
+		TreeNode* children = nullptr;
+		TreeNode* parent = nullptr;
+
+		// Total mass and center of mass of all data stored under this node
+		float mass = 0.f;
+		pairf centerOfMass = {0.f, 0.f};
+
+		using Pool = NodePool<TreeNode, sections>;
+
+		// Nodes are reused by the pool, so reset everything except the capacity of the bin
+		void reset(const Bounds &bounds, TreeNode* parent=nullptr) {
+			this->bounds = bounds;
+			this->parent = parent;
+			depth = parent ? parent->depth + 1 : 0;
+			values.clear();
+			leafCount = 0;
+			container = false;
+			children = nullptr;
+			mass = 0.f;
+			centerOfMass = {0.f, 0.f};
+		}
+
+		// Include a piece of data in the mass aggregates of this node
+		template<class Reducer>
+		void addMass(const Reducer &reducer, const Data &data) {
+			float m = reducer.mass(data);
+			pairf p = reducer.position(data);
+			float total = mass + m;
+			if (total <= 0.f) return;
+			centerOfMass.first = (centerOfMass.first * mass + p.first * m) / total;
+			centerOfMass.second = (centerOfMass.second * mass + p.second * m) / total;
+			mass = total;
+		}
+
+		// Index of the first child that contains data in its bounding box. Data outside of
+		// every child, like data outside the root or on a cell edge after Morton
+		// quantization, goes to the closest child instead
+		template<class Reducer>
+		int childIndex(const Reducer &reducer, const Data &data) const {
+			for (int i = 0; i < sections; i++) {
+				if (reducer.inBounds(data, children[i].bounds)) return i;
+			}
+			int closest = 0;
+			for (int i = 1; i < sections; i++) {
+				if (reducer.minDistance(data, children[i].bounds) < reducer.minDistance(data, children[closest].bounds)) closest = i;
+			}
+			return closest;
+		}
+
+		// Recompute the mass aggregates of a container from its children
+		void sumChildren() {
+			float total = 0.f;
+			pairf moment = {0.f, 0.f};
+			for (int i = 0; i < sections; i++) {
+				total += children[i].mass;
+				moment.first += children[i].centerOfMass.first * children[i].mass;
+				moment.second += children[i].centerOfMass.second * children[i].mass;
+			}
+			mass = total;
+			centerOfMass = total > 0.f ? pairf(moment.first / total, moment.second / total) : pairf(0.f, 0.f);
+		}
 
-		TreeNode(bool container, Bounds bounds, TreeReducer<Data, Bounds> *reducer, TreeNode* parent=nullptr): bounds(bounds), parent(parent) {
-			this->reducer = reducer;
-			if (container) makeContainer();
+		// Recompute the mass aggregates of a leaf from its data
+		template<class Reducer>
+		void sumValues(const Reducer &reducer, const Data *elements) {
+			float total = 0.f;
+			pairf moment = {0.f, 0.f};
+			for (uint32_t value : values) {
+				float m = reducer.mass(elements[value]);
+				pairf p = reducer.position(elements[value]);
+				total += m;
+				moment.first += p.first * m;
+				moment.second += p.second * m;
+			}
+			mass = total;
+			centerOfMass = total > 0.f ? pairf(moment.first / total, moment.second / total) : pairf(0.f, 0.f);
 		}
 
 		// Move all stored data into child nodes
-		void makeContainer() {
+		template<class Reducer>
+		void makeContainer(Pool &pool, const Reducer &reducer, const Data *elements) {
 			if (this->container) return;
 			leafCount = values.size();
 
+			children = pool.allocate();
 			for (int i = 0; i < sections; i++) {
-				auto b = reducer->getBounds(this->bounds, i);
-				children[i] = new TreeNode<Data, Bounds, sections>(false, b, reducer, this);
+				children[i].reset(reducer.getBounds(this->bounds, i), this);
 			}
 
-			for (auto value : values) {
-				for (int j = 0; j < sections; j++) {
-					if (reducer->inBounds(*value, children[j]->bounds)) {
-						children[j]->values.insert(value);
-						break;
-					}
-				}
+			for (uint32_t value : values) {
+				TreeNode &child = children[childIndex(reducer, elements[value])];
+				child.values.push_back(value);
+				child.leafCount++;
+				child.addMass(reducer, elements[value]);
 			}
 			values.clear();
 			this->container = true;
 		}
 
 		// Absorb all data from child nodes/containers
-		void makeStorage() {
+		void makeStorage(Pool &pool) {
 			if (!this->container) return;
 			for (int i = 0; i < sections; i++) {
-				if (children[i]->container) children[i]->makeStorage();
-				for (Data* data : children[i]->values) {
-					values.insert(data);
-				}
-				delete children[i];
+				if (children[i].container) children[i].makeStorage(pool);
+				values.insert(values.end(), children[i].values.begin(), children[i].values.end());
 			}
+			pool.release(children);
+			children = nullptr;
 
 			this->container = false;
 		}
-
-		~TreeNode() {
-			if (container) for (int i = 0; i < sections; i++) delete children[i];
-		}
 	};
 
 	
-	template<class Data = pairf, class Bounds=std::pair<pairf, pairf>, unsigned int sections=4>
+	template<class Data = pairf, class Bounds=std::pair<pairf, pairf>, unsigned int sections=4, class Reducer=TreeReducer<Data, Bounds>>
 	class QuadTree {
 	public:
 		using Node=TreeNode<Data, Bounds, sections>;
 		int binSize;
+		// Leaves at this depth are never split, so they may hold more than binSize data
+		int maxDepth = 16;
 		QuadTree(
 				int binSize,
 				Bounds rootBounds = std::pair<pairf, pairf>{ {-1.f, -1.f}, {1.f, 1.f} },
-				TreeReducer<Data, Bounds> reducer = {.distance=distance, .inBounds=inBounds, .minDistance=minDistance, .getBounds=getBounds}) 
-			: binSize(binSize), rootBounds(rootBounds), reducer(reducer) {
+				Reducer reducer = defaultReducer<Reducer>())
+			: binSize(binSize), rootBounds(rootBounds), reducer(reducer), pools(1) {
 
-			root = new Node(true, rootBounds, &this->reducer);
-		}
-		~QuadTree() {
-			delete root;
+			root = pools[0].allocate();
+			root->reset(rootBounds);
+			root->makeContainer(pools[0], this->reducer, elements);
 		}
 
-		std::unordered_map<Data*, Node*> dataLocations;
+		// Data is identified by its index in the vector the tree was initialized with.
+		// Inserted data must live in that vector too
+		Data* elements = nullptr;
+		uint32_t idOf(const Data &data) const { return &data - elements; }
+
+		// Leaf holding each piece of data, indexed by id. Removed data is nullptr
+		std::vector<Node*> dataLocations;
+
+		// Id written for missing results when the tree holds fewer than n elements
+		static constexpr uint32_t noId = UINT32_MAX;
+
+		// Buffers for a nearest search, kept between queries so they don't allocate
+		struct NearestScratch {
+			// Nodes left to search, as a heap keyed on the negated minimum distance
+			std::vector<std::pair<float, Node*>> queue;
+			// The closest elements found so far as a max heap of distance and id
+			std::vector<std::pair<float, uint32_t>> closest;
+		};
+
+		Data* nearest(const Data &obj) const;
+		// Closest n elements keyed by distance. Elements at the same distance collapse
+		// into one entry, use the id version to get all of them
+		std::map<float, Data*> nearest(const Data &obj, int n) const;
+		// Write the ids and distances of the n closest elements to obj, closest first.
+		// Missing results get noId and an infinite distance
+		void nearest(const Data &obj, int n, uint32_t *ids, float *distances, NearestScratch &scratch) const;
+		// Find the n closest elements to each of count queries in parallel. Results for
+		// query i are written to ids and distances starting at i * n
+		void nearest(const Data *queries, size_t count, int n, uint32_t *ids, float *distances) const;
+
+		// Call visit(id) for the data in every leaf within maxDistance of obj, as measured by
+		// reducer.minDistance. visit does the exact test. stack is reused between queries
+		template<class Visit>
+		void within(const Data &obj, float maxDistance, Visit &&visit, std::vector<const Node*> &stack) const {
+			stack.clear();
+			stack.push_back(root);
+			while (stack.size()) {
+				const Node* node = stack.back();
+				stack.pop_back();
+				if (node->container) {
+					for (int i = 0; i < sections; i++) {
+						const Node* child = &node->children[i];
+						bool empty = child->container ? child->leafCount == 0 : child->values.empty();
+						if (!empty && reducer.minDistance(obj, child->bounds) <= maxDistance) stack.push_back(child);
+					}
+				}
+				else for (uint32_t id : node->values) visit(id);
+			}
+		}
 
-		Data* nearest(Data obj) const;
-		std::map<float, Data*> nearest(Data obj, int n) const;
+		// Distance from obj to the data with each id
+		void leafDistances(const Data &obj, const uint32_t *ids, int n, float *out) const {
+			if constexpr (hasDistances<Reducer, Data>::value) reducer.distances(obj, elements, ids, n, out);
+			else for (int i = 0; i < n; i++) out[i] = reducer.distance(obj, elements[ids[i]]);
+		}
 
 		// Insert a node, creating containers as necessary
-		// TODO: There should be a maximum recursion depth for insert 
-		// 		 if the limit is exceeded it's ok to create a node with > binSize data
 		Node* insert(Data& data, Node* node);
 
-		// Initialize the quadtree with a vector
+		// Initialize the quadtree with a vector. The data is sorted along a Morton curve
+		// so every node covers a contiguous range and the tree is built in a single pass
 		void initialize(std::vector<Data> &data);
+		// Sort the ids in the lower half of keys along a Morton curve over the bounds of node
+		// and build the subtree under it
+		void rebuild(Node* node);
+		// Build the subtree under node from the sorted keys in [begin, end). level is the
+		// number of Morton digits above node, counted from the node rebuild started at
+		void build(Node* node, size_t begin, size_t end, int level);
 
 		// Store the parent node of every piece of data under node in dataLocations
 		void indexData(Node* node);
@@ -124,74 +407,130 @@ namespace quadtree {
 		// Update the index of a piece of data after a change
 		bool update(Data& data);
 
+		// Update the index after any of the data changed. Only data that left its leaf is
+		// moved, starting from the lowest ancestor that still contains it. Containers left
+		// with at most half a bin are merged back into leaves, then the mass aggregates are
+		// recomputed. Returns the number of data that moved
+		size_t reindexMoved();
+		// Take data out of its leaf and insert it again from the lowest ancestor containing it.
+		// Returns the parent of the leaf it left
+		Node* relocate(uint32_t id);
+		// Highest container at or above node that holds at most half a bin, or nullptr
+		Node* underfull(Node* node) const;
+		// Merge the underfull container above node into a leaf. Returns the merged node or nullptr
+		Node* collapse(Node* node);
+		// Recompute the mass aggregates of every node under node
+		void sumMass(Node* node);
+		// Recompute the mass aggregates of node and every node above it
+		void sumMassUp(Node* node);
+
 		// Update the every item in the tree
 		void reindex() { reindex(root); }
+		// Rebuild the subtree under node from the data it holds. Data that moved out of
+		// the bounds of node is kept in its closest cell
 		void reindex(Node* node);
 
+		// Take data out of the tree, merging the containers left with at most half a bin.
+		// Returns the merged node, or the leaf the data was in
 		Node* remove(Data& data);
 
-		TreeReducer<Data, Bounds> reducer;
+		// Replace every id with newIds[id] after the caller reordered its data. The data
+		// must have the same values so the tree structure still holds
+		void renumber(const std::vector<uint32_t> &newIds);
+		void renumber(Node* node, const std::vector<uint32_t> &newIds);
+
+		Reducer reducer;
+		// One pool per thread so parallel builds don't contend on the allocator.
+		// Serial operations like insert and remove use the first one
+		std::vector<typename Node::Pool> pools;
 		Node *root;
 		Bounds rootBounds;
+
+		// Subtrees with more data than this are built by their own task
+		size_t taskGrain = 4096;
+
+		// Morton code in the upper 32 bits and id in the lower 32 bits, used by rebuild
+		std::vector<uint64_t> keys, sortScratch;
+		// Data found outside its leaf and containers that lost data, used by reindexMoved
+		std::vector<uint32_t> moved;
+		std::vector<Node*> shrunk;
 	};
 }
 
-template<class Data, class Bounds, unsigned int sections>
+template<class Data, class Bounds, unsigned int sections, class Reducer>
 quadtree::TreeNode<Data, Bounds, sections>*
-quadtree::QuadTree<Data, Bounds, sections>::insert(Data& data, Node *node) {
+quadtree::QuadTree<Data, Bounds, sections, Reducer>::insert(Data& data, Node *node) {
+	uint32_t id = idOf(data);
+	if (id >= dataLocations.size()) dataLocations.resize(id + 1, nullptr);
+
 	// Find a leaf node
 	while (node->container) {
-		// Take the first container that contains node in its bounding box
-		for (int i = 0; i < sections; i++) {
-			if (reducer.inBounds(data, node->children[i]->bounds)) {
-				node->leafCount++;
-				node = node->children[i];
-				break;
-			}
-		}
+		node->leafCount++;
+		node->addMass(reducer, data);
+		node = &node->children[node->childIndex(reducer, data)];
 	}
-	node->leafCount++;
 
 	// If possible store this in the nodes bin
-	if (node->values.size() < binSize) {
-		node->values.insert(&data);
-		dataLocations[&data] = node;
+	if (node->values.size() < binSize || node->depth >= maxDepth) {
+		if (node->values.capacity() < binSize) node->values.reserve(binSize);
+		node->leafCount++;
+		node->addMass(reducer, data);
+		node->values.push_back(id);
+		dataLocations[id] = node;
 		return node;
 	}
 
 	// Reindex the node if necessary
-	node->makeContainer();
+	node->makeContainer(pools[0], reducer, elements);
 	indexData(node);
 
 	return insert(data, node);
 }
 
-template<class Data, class Bounds, unsigned int sections>
-Data* quadtree::QuadTree<Data, Bounds, sections>::nearest(Data obj) const {
-	return nearest(obj, 1).begin()->second;
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+Data* quadtree::QuadTree<Data, Bounds, sections, Reducer>::nearest(const Data &obj) const {
+	static thread_local NearestScratch scratch;
+	uint32_t id;
+	float distance;
+	nearest(obj, 1, &id, &distance, scratch);
+	return id == noId ? nullptr : elements + id;
 }
-template<class Data, class Bounds, unsigned int sections>
-std::map<float, Data*> quadtree::QuadTree<Data, Bounds, sections>::nearest(Data obj, int n) const {
-	auto compare = [](std::pair<float, void*> l, std::pair<float, void*> r) {
-		return l.first < r.first;
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+std::map<float, Data*> quadtree::QuadTree<Data, Bounds, sections, Reducer>::nearest(const Data &obj, int n) const {
+	static thread_local NearestScratch scratch;
+	std::vector<uint32_t> ids(n);
+	std::vector<float> distances(n);
+	nearest(obj, n, ids.data(), distances.data(), scratch);
+
+	// Make a map out of the distances
+	std::map<float, Data*> out;
+	for (int i = 0; i < n; i ++) {
+		if (ids[i] != noId) out.emplace(distances[i], elements + ids[i]);
+	}
+	return out;
+}
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::nearest(const Data &obj, int n, uint32_t *ids, float *distances,
+		NearestScratch &scratch) const {
+	auto compare = [](const auto &l, const auto &r) {
+		return l < r;
 	};
 
-	std::priority_queue<std::pair<float, Node*>, std::vector<std::pair<float, Node*>>, decltype(compare)> dfs(compare);
-	dfs.emplace(0.f, root);
-	
+	auto &dfs = scratch.queue;
+	dfs.clear();
+	dfs.emplace_back(0.f, root);
+
+	// Closest items are stored as a heap of n + 1 and the largest one is removed every iteration
+	auto &closest = scratch.closest;
+	closest.assign(n + 1, std::pair<float, uint32_t>(INFINITY, noId));
 	float minDist = INFINITY;
-	// Save memory by using a raw heap instead of a priority queue
-	// Closest items are stored as a heap and the largest one is removed every iteration
-	std::pair<float, Data*>* closest = new std::pair<float, Data*>[n + 1];
-	for (int i = 0; i < n + 1; i++) closest[i].first = INFINITY;
-	std::make_heap(closest, closest + n + 1, compare);
 
 	while (dfs.size() > 0) {
-		auto top = dfs.top();
+		std::pop_heap(dfs.begin(), dfs.end(), compare);
+		auto top = dfs.back();
+		dfs.pop_back();
 		Node* current = top.second;
 		float dist = -top.first;
-		dfs.pop();
-
 
 		if (dist >= minDist) {
 			continue;
@@ -199,124 +538,351 @@ std::map<float, Data*> quadtree::QuadTree<Data, Bounds, sections>::nearest(Data
 		// Queue up child nodes for search if the current node is a container
 		if (current->container) {
 			for (int i = 0; i < sections; i++) {
-				float childMinDist = reducer.minDistance(obj, current->children[i]->bounds);
-				bool containsSubNodes = (current->children[i]->container && current->children[i]->leafCount > 0);
-				if ((containsSubNodes || current->children[i]->values.size() > 0) && childMinDist < minDist)
-					dfs.emplace(-childMinDist, current->children[i]);
+				Node* child = &current->children[i];
+				float childMinDist = reducer.minDistance(obj, child->bounds);
+				bool containsSubNodes = (child->container && child->leafCount > 0);
+				if ((containsSubNodes || child->values.size() > 0) && childMinDist < minDist) {
+					dfs.emplace_back(-childMinDist, child);
+					std::push_heap(dfs.begin(), dfs.end(), compare);
+				}
 			}
 		}
 		// Update the closest elements
 		else {
-			for (auto value : current->values) {
-				float currentDist = reducer.distance(obj, *value);
-				if (currentDist <= minDist) {
-					// Push the current element to the heap
-					closest[n] = std::pair<float, Data*>(currentDist, value);
-					std::push_heap(closest, closest + n + 1, compare);
-
-					// Use the highest distance in the heap as minDist.
-					// This is the smallest distance that is guaranteed to not be in the top n
-					// closest elements.
-					minDist = closest[0].first;
-					// Remove the highest so the heap now contains the n smallest visited values
-					std::pop_heap(closest, closest + n + 1, compare);
+			// Distances are found a chunk of the leaf at a time so batched reducers can use SIMD
+			float leafDists[64];
+			for (size_t start = 0; start < current->values.size(); start += 64) {
+				int count = std::min(current->values.size() - start, (size_t)64);
+				leafDistances(obj, current->values.data() + start, count, leafDists);
+
+				for (int i = 0; i < count; i++) {
+					float currentDist = leafDists[i];
+					if (currentDist <= minDist) {
+						// Push the current element to the heap
+						closest[n] = std::pair<float, uint32_t>(currentDist, current->values[start + i]);
+						std::push_heap(closest.begin(), closest.end(), compare);
+
+						// Remove the highest so the heap now contains the n smallest visited values
+						std::pop_heap(closest.begin(), closest.end(), compare);
+						// Anything further than the highest distance left can't be in the
+						// closest n elements
+						minDist = closest[0].first;
+					}
 				}
 			}
 		}
 	}
 
-	// Make a map out of the distances
-	std::map<float, Data*> out;
-	for (int i = 0; i < n; i ++) {
-		if (closest[i].second) out.insert(closest[i]);
+	// The removed element is last, sort the rest closest first
+	std::sort(closest.begin(), closest.end() - 1);
+	for (int i = 0; i < n; i++) {
+		ids[i] = closest[i].second;
+		distances[i] = closest[i].first;
+	}
+}
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::nearest(const Data *queries, size_t count, int n,
+		uint32_t *ids, float *distances) const {
+#pragma omp parallel
+	{
+		// Every thread reuses its own buffers for all of its queries
+		NearestScratch scratch;
+#pragma omp for schedule(dynamic, 256)
+		for (size_t i = 0; i < count; i++) {
+			nearest(queries[i], n, ids + i * n, distances + i * n, scratch);
+		}
 	}
-
-	delete[] closest;
-
-	return out;
 }
 
 
-template<class Data, class Bounds, unsigned int sections>
-void quadtree::QuadTree<Data, Bounds, sections>::indexData(Node* node) {
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::indexData(Node* node) {
 	if (node->container) {
-		for (int i = 0; i < sections; i++) indexData(node->children[i]);
+		for (int i = 0; i < sections; i++) indexData(&node->children[i]);
 		return;
 	}
-	for (auto value : node->values) {
+	for (uint32_t value : node->values) {
 		dataLocations[value] = node;
 	}
 }
 
-template<class Data, class Bounds, unsigned int sections>
-quadtree::TreeNode<Data, Bounds, sections>* quadtree::QuadTree<Data, Bounds, sections>::remove(Data& data) {
-	Node* node = dataLocations[&data];
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+quadtree::TreeNode<Data, Bounds, sections>* quadtree::QuadTree<Data, Bounds, sections, Reducer>::remove(Data& data) {
+	uint32_t id = idOf(data);
+	Node* leaf = dataLocations[id];
 
-	node->values.erase(&data);
+	// Bins are unordered so the last value can fill the gap
+	auto found = std::find(leaf->values.begin(), leaf->values.end(), id);
+	*found = leaf->values.back();
+	leaf->values.pop_back();
 
-	dataLocations.erase(&data);
+	dataLocations[id] = nullptr;
 
-	// Propagate the new number of leaf nodes up the tree
-	// Store the last node that doesn't need to be a container
-	Node* topNonContainer = nullptr;
+	// Every node from the leaf to the root loses the data
+	for (Node* node = leaf; node != nullptr; node = node->parent) node->leafCount--;
 
-	while (node->parent != nullptr) {
-		if (node->container) node->leafCount--;
-		if (node->leafCount <= binSize) topNonContainer = node;
-		node = node->parent;
+	// Merge like reindexMoved so both paths use the same threshold. The data may have
+	// moved since the aggregates were summed, so sum them again instead of taking it out
+	// at its current position
+	Node* merged = collapse(leaf->parent);
+	Node* node = merged ? merged : leaf;
+	sumMassUp(node);
+	return node;
+}
+
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+bool quadtree::QuadTree<Data, Bounds, sections, Reducer>::update(Data& target) {
+	uint32_t id = idOf(target);
+	if (id >= dataLocations.size() || !dataLocations[id]) return false;
+
+	Node *node = dataLocations[id];
+	if (!reducer.inBounds(target, node->bounds)) {
+		Node *merged = collapse(relocate(id));
+		// The old leaf was released if one of its ancestors was merged
+		if (merged) node = merged;
+		sumMassUp(dataLocations[id]);
 	}
+	sumMassUp(node);
+	return true;
+}
 
-	if (topNonContainer) {
-		topNonContainer->makeStorage();
-		indexData(topNonContainer);
-		return topNonContainer;
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+quadtree::TreeNode<Data, Bounds, sections>* quadtree::QuadTree<Data, Bounds, sections, Reducer>::relocate(uint32_t id) {
+	Node* leaf = dataLocations[id];
+	auto found = std::find(leaf->values.begin(), leaf->values.end(), id);
+	*found = leaf->values.back();
+	leaf->values.pop_back();
+
+	// Every node left on the way up loses the data, and insert adds it back to the
+	// nodes on the way down, including the ancestor itself
+	Node* node = leaf;
+	node->leafCount--;
+	while (node->parent && !reducer.inBounds(elements[id], node->bounds)) {
+		node = node->parent;
+		node->leafCount--;
 	}
+	insert(elements[id], node);
+	return leaf->parent;
+}
 
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+quadtree::TreeNode<Data, Bounds, sections>* quadtree::QuadTree<Data, Bounds, sections, Reducer>::underfull(Node* node) const {
+	// Merging at half a bin instead of a full one keeps data on a cell edge from
+	// splitting and merging the same node every step. The root is always a container
+	int limit = binSize / 2;
+	if (!node || !node->parent || !node->container || node->leafCount > limit) return nullptr;
+	while (node->parent->parent && node->parent->leafCount <= limit) node = node->parent;
 	return node;
 }
 
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+quadtree::TreeNode<Data, Bounds, sections>* quadtree::QuadTree<Data, Bounds, sections, Reducer>::collapse(Node* node) {
+	node = underfull(node);
+	if (!node) return nullptr;
 
-template<class Data, class Bounds, unsigned int sections>
-bool quadtree::QuadTree<Data, Bounds, sections>::update(Data& target) {
-	if (!dataLocations[&target]) return false;
+	node->makeStorage(pools[0]);
+	indexData(node);
+	return node;
+}
 
-	Node *node = remove(target);
-	
-	// Move upwards until the new value is in bounds
-	while (node->parent && !reducer.inBounds(target, node->bounds)) {
-		node = node->parent;
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+size_t quadtree::QuadTree<Data, Bounds, sections, Reducer>::reindexMoved() {
+	// Find the data outside its leaf in parallel. Each thread collects its own list
+	moved.clear();
+	#pragma omp parallel
+	{
+		std::vector<uint32_t> local;
+		#pragma omp for nowait
+		for (size_t id = 0; id < dataLocations.size(); id++) {
+			if (dataLocations[id] && !reducer.inBounds(elements[id], dataLocations[id]->bounds)) local.push_back(id);
+		}
+		#pragma omp critical
+		moved.insert(moved.end(), local.begin(), local.end());
 	}
-	insert(target, root);
-	return true;
+	// Move in id order so the tree doesn't depend on the thread schedule
+	std::sort(moved.begin(), moved.end());
+
+	shrunk.clear();
+	for (uint32_t id : moved) shrunk.push_back(relocate(id));
+
+	// Every container that can be merged is under exactly one highest mergeable ancestor,
+	// so the merged subtrees never overlap. Find them all before changing the tree
+	for (Node* &node : shrunk) node = underfull(node);
+	std::sort(shrunk.begin(), shrunk.end());
+	shrunk.erase(std::unique(shrunk.begin(), shrunk.end()), shrunk.end());
+	for (Node* node : shrunk) collapse(node);
+
+	#pragma omp parallel
+	#pragma omp single
+	sumMass(root);
+	return moved.size();
 }
 
-template<class Data, class Bounds, unsigned int sections>
-void quadtree::QuadTree<Data, Bounds, sections>::reindex(Node* root) {
-	// Reset the leafNodes and storage of all subtrees
-	std::queue<Node *> bfs;
-	bfs.push(root);
-	while (bfs.size()) {
-		Node* top = bfs.front();
-		bfs.pop();
-		
-		top->leafCount = 0;
-		top->values.clear();
-		if (top->container) for (int i = 0; i < sections; i++) bfs.push(top->children[i]);
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::sumMass(Node* node) {
+	if (!node->container) {
+		node->sumValues(reducer, elements);
+		return;
+	}
+
+	for (int i = 0; i < sections; i++) {
+		Node* child = &node->children[i];
+		if (child->leafCount > taskGrain) {
+			#pragma omp task
+			sumMass(child);
+		}
+		else sumMass(child);
+	}
+	#pragma omp taskwait
+	node->sumChildren();
+}
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::sumMassUp(Node* node) {
+	if (!node->container) node->sumValues(reducer, elements);
+	else node->sumChildren();
+	for (Node* parent = node->parent; parent != nullptr; parent = parent->parent) parent->sumChildren();
+}
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::reindex(Node* node) {
+	keys.clear();
+	if (node == root) {
+		// Walk the data in memory order, skipping anything that was removed
+		for (uint32_t id = 0; id < dataLocations.size(); id++) {
+			if (dataLocations[id]) keys.push_back(id);
+		}
+
+		// Every node is released at once, the slabs and bins are reused by the new tree
+		for (auto &pool : pools) pool.clear();
+		root = node = pools[0].allocate();
+		root->reset(rootBounds);
+	}
+	else {
+		node->makeStorage(pools[0]);
+		keys.assign(node->values.begin(), node->values.end());
+		node->reset(node->bounds, node->parent);
+	}
+
+	rebuild(node);
+
+	// The data under node may have moved so the ancestors need new totals
+	for (Node* parent = node->parent; parent != nullptr; parent = parent->parent) {
+		parent->sumChildren();
+	}
+}
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::renumber(const std::vector<uint32_t> &newIds) {
+	std::vector<Node*> locations(dataLocations.size(), nullptr);
+	#pragma omp parallel for
+	for (size_t id = 0; id < dataLocations.size(); id++) {
+		if (dataLocations[id]) locations[newIds[id]] = dataLocations[id];
+	}
+	dataLocations.swap(locations);
+
+	#pragma omp parallel
+	#pragma omp single
+	renumber(root, newIds);
+}
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::renumber(Node* node, const std::vector<uint32_t> &newIds) {
+	if (!node->container) {
+		for (uint32_t &id : node->values) id = newIds[id];
+		return;
 	}
 
-	for (auto data : dataLocations) {
-		insert(*data.first, root);
+	for (int i = 0; i < sections; i++) {
+		Node* child = &node->children[i];
+		if (child->leafCount > taskGrain) {
+			#pragma omp task
+			renumber(child, newIds);
+		}
+		else renumber(child, newIds);
 	}
+	#pragma omp taskwait
 }
 
-template<class Data, class Bounds, unsigned int sections>
-void quadtree::QuadTree<Data, Bounds, sections>::initialize(std::vector<Data> &data) {
-	delete root;
-	root = new Node(true, rootBounds, &reducer);
-	root->bounds = rootBounds;
-	for (int i = 0; i < data.size(); i++) {
-		insert(data[i], root);
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::initialize(std::vector<Data> &data) {
+	// Every node is released at once, the slabs and bins are reused by the new tree
+	for (auto &pool : pools) pool.clear();
+	elements = data.data();
+	dataLocations.assign(data.size(), nullptr);
+
+	keys.resize(data.size());
+	#pragma omp parallel for
+	for (size_t i = 0; i < data.size(); i++) keys[i] = i;
+
+	root = pools[0].allocate();
+	root->reset(rootBounds);
+	rebuild(root);
+}
+
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::rebuild(Node* node) {
+	static_assert(sections == 4, "Morton codes have two bits per level");
+
+	Bounds bounds = node->bounds;
+	#pragma omp parallel for
+	for (size_t i = 0; i < keys.size(); i++) {
+		uint32_t id = keys[i];
+		keys[i] = (uint64_t)mortonCode(reducer.position(elements[id]), bounds) << 32 | id;
 	}
+	sortByCode(keys, sortScratch);
+
+	// Spread the blocks freed by serial operations over the thread pools
+	if (pools.size() < threadCount()) pools.resize(threadCount());
+	size_t share = pools[0].freeCount() / pools.size();
+	for (size_t i = 1; i < pools.size(); i++) pools[0].share(pools[i], share);
+
+	// The top levels are split serially and every large subtree becomes a task
+	#pragma omp parallel
+	#pragma omp single
+	build(node, 0, keys.size(), 0);
 }
 
+template<class Data, class Bounds, unsigned int sections, class Reducer>
+void quadtree::QuadTree<Data, Bounds, sections, Reducer>::build(Node* node, size_t begin, size_t end, int level) {
+	node->leafCount = end - begin;
+
+	// The root is always a container, like in the constructor
+	if (node != root && (end - begin <= binSize || node->depth >= maxDepth || level >= mortonDepth)) {
+		node->values.reserve(std::max(end - begin, (size_t)binSize));
+		for (size_t i = begin; i < end; i++) {
+			uint32_t id = keys[i];
+			node->values.push_back(id);
+			// Ids are unique so tasks never write the same location
+			dataLocations[id] = node;
+		}
+		node->sumValues(reducer, elements);
+		return;
+	}
 
+	node->container = true;
+	node->children = pools[threadIndex()].allocate();
+
+	// Keys in the range share every digit above this level, so each child is the
+	// contiguous run of keys with the next digit equal to its index
+	int shift = 32 + 2 * (mortonDepth - 1 - level);
+	size_t start = begin;
+	for (int i = 0; i < sections; i++) {
+		Node* child = &node->children[i];
+		child->reset(reducer.getBounds(node->bounds, i), node);
+
+		size_t stop = std::partition_point(keys.begin() + start, keys.begin() + end, [&](uint64_t key) {
+			return (int)((key >> shift) & 3) <= i;
+		}) - keys.begin();
+		if (stop - start > taskGrain) {
+			#pragma omp task
+			build(child, start, stop, level + 1);
+		}
+		else build(child, start, stop, level + 1);
+		start = stop;
+	}
+	#pragma omp taskwait
+
+	node->sumChildren();
+}
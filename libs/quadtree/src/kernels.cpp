@@ -0,0 +1,158 @@
+#include <quadtree/kernels.hpp>
+#include <cmath>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define QUADTREE_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace quadtree::kernels;
+
+namespace {
+	enum class Level { Scalar, AVX2, AVX512 };
+
+	Level detect() {
+#if QUADTREE_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f")) return Level::AVX512;
+		if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Level::AVX2;
+#endif
+		return Level::Scalar;
+	}
+
+	Level level() {
+		static const Level detected = detect();
+		return detected;
+	}
+
+	void squaredDistancesScalar(float qx, float qy, const float *x, const float *y, int stride,
+			const uint32_t *ids, int n, float *out) {
+		for (int i = 0; i < n; i++) {
+			float dx = x[(size_t)ids[i] * stride] - qx;
+			float dy = y[(size_t)ids[i] * stride] - qy;
+			out[i] = dx * dx + dy * dy;
+		}
+	}
+
+	void gravityScalar(float px, float py, const float *x, const float *y, const float *m, int n,
+			float softening, float &ax, float &ay) {
+		for (int i = 0; i < n; i++) {
+			float dx = x[i] - px, dy = y[i] - py;
+			float dist2 = dx * dx + dy * dy;
+			if (dist2 == 0.f) continue;
+			dist2 += softening;
+			float scale = m[i] / (dist2 * std::sqrt(dist2));
+			ax += dx * scale;
+			ay += dy * scale;
+		}
+	}
+
+#if QUADTREE_X86
+	__attribute__((target("avx2,fma")))
+	void squaredDistancesAVX2(float qx, float qy, const float *x, const float *y, int stride,
+			const uint32_t *ids, int n, float *out) {
+		__m256 vqx = _mm256_set1_ps(qx), vqy = _mm256_set1_ps(qy);
+		__m256i vstride = _mm256_set1_epi32(stride);
+		int i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m256i index = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i *)(ids + i)), vstride);
+			__m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(x, index, 4), vqx);
+			__m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(y, index, 4), vqy);
+			_mm256_storeu_ps(out + i, _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)));
+		}
+		squaredDistancesScalar(qx, qy, x, y, stride, ids + i, n - i, out + i);
+	}
+
+	__attribute__((target("avx2,fma")))
+	void gravityAVX2(float px, float py, const float *x, const float *y, const float *m, int n,
+			float softening, float &ax, float &ay) {
+		__m256 vpx = _mm256_set1_ps(px), vpy = _mm256_set1_ps(py);
+		__m256 vsoft = _mm256_set1_ps(softening), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+		__m256 sumX = zero, sumY = zero;
+		int i = 0;
+		for (; i + 8 <= n; i += 8) {
+			__m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vpx);
+			__m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vpy);
+			__m256 dist2 = _mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy));
+			__m256 self = _mm256_cmp_ps(dist2, zero, _CMP_EQ_OQ);
+			dist2 = _mm256_add_ps(dist2, vsoft);
+			__m256 inverse = _mm256_div_ps(one, _mm256_mul_ps(dist2, _mm256_sqrt_ps(dist2)));
+			__m256 scale = _mm256_andnot_ps(self, _mm256_mul_ps(_mm256_loadu_ps(m + i), inverse));
+			sumX = _mm256_fmadd_ps(dx, scale, sumX);
+			sumY = _mm256_fmadd_ps(dy, scale, sumY);
+		}
+
+		alignas(32) float lanesX[8], lanesY[8];
+		_mm256_store_ps(lanesX, sumX);
+		_mm256_store_ps(lanesY, sumY);
+		for (int j = 0; j < 8; j++) {
+			ax += lanesX[j];
+			ay += lanesY[j];
+		}
+		gravityScalar(px, py, x + i, y + i, m + i, n - i, softening, ax, ay);
+	}
+
+	__attribute__((target("avx512f")))
+	void squaredDistancesAVX512(float qx, float qy, const float *x, const float *y, int stride,
+			const uint32_t *ids, int n, float *out) {
+		__m512 vqx = _mm512_set1_ps(qx), vqy = _mm512_set1_ps(qy);
+		__m512i vstride = _mm512_set1_epi32(stride);
+		for (int i = 0; i < n; i += 16) {
+			__mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+			__m512i index = _mm512_mullo_epi32(_mm512_maskz_loadu_epi32(mask, ids + i), vstride);
+			__m512 dx = _mm512_sub_ps(_mm512_mask_i32gather_ps(vqx, mask, index, x, 4), vqx);
+			__m512 dy = _mm512_sub_ps(_mm512_mask_i32gather_ps(vqy, mask, index, y, 4), vqy);
+			_mm512_mask_storeu_ps(out + i, mask, _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy)));
+		}
+	}
+
+	__attribute__((target("avx512f")))
+	void gravityAVX512(float px, float py, const float *x, const float *y, const float *m, int n,
+			float softening, float &ax, float &ay) {
+		__m512 vpx = _mm512_set1_ps(px), vpy = _mm512_set1_ps(py);
+		__m512 vsoft = _mm512_set1_ps(softening), zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.f);
+		__m512 sumX = zero, sumY = zero;
+		for (int i = 0; i < n; i += 16) {
+			__mmask16 mask = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1);
+			// Masked out lanes load the position of the body itself so they are skipped as well
+			__m512 dx = _mm512_sub_ps(_mm512_mask_loadu_ps(vpx, mask, x + i), vpx);
+			__m512 dy = _mm512_sub_ps(_mm512_mask_loadu_ps(vpy, mask, y + i), vpy);
+			__m512 dist2 = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+			__mmask16 other = _mm512_cmp_ps_mask(dist2, zero, _CMP_NEQ_UQ);
+			dist2 = _mm512_add_ps(dist2, vsoft);
+			__m512 inverse = _mm512_div_ps(one, _mm512_mul_ps(dist2, _mm512_sqrt_ps(dist2)));
+			__m512 scale = _mm512_maskz_mul_ps(other, _mm512_maskz_loadu_ps(mask, m + i), inverse);
+			sumX = _mm512_fmadd_ps(dx, scale, sumX);
+			sumY = _mm512_fmadd_ps(dy, scale, sumY);
+		}
+		ax += _mm512_reduce_add_ps(sumX);
+		ay += _mm512_reduce_add_ps(sumY);
+	}
+#endif
+}
+
+void quadtree::kernels::squaredDistances(float qx, float qy, const float *x, const float *y, int stride,
+		const uint32_t *ids, int n, float *out) {
+#if QUADTREE_X86
+	if (level() == Level::AVX512) return squaredDistancesAVX512(qx, qy, x, y, stride, ids, n, out);
+	if (level() == Level::AVX2) return squaredDistancesAVX2(qx, qy, x, y, stride, ids, n, out);
+#endif
+	squaredDistancesScalar(qx, qy, x, y, stride, ids, n, out);
+}
+
+void quadtree::kernels::gravity(float px, float py, const float *x, const float *y, const float *m, int n,
+		float softening, float &ax, float &ay) {
+#if QUADTREE_X86
+	if (level() == Level::AVX512) return gravityAVX512(px, py, x, y, m, n, softening, ax, ay);
+	if (level() == Level::AVX2) return gravityAVX2(px, py, x, y, m, n, softening, ax, ay);
+#endif
+	gravityScalar(px, py, x, y, m, n, softening, ax, ay);
+}
+
+const char *quadtree::kernels::instructionSet() {
+	switch (level()) {
+		case Level::AVX512: return "AVX-512";
+		case Level::AVX2: return "AVX2";
+		default: return "scalar";
+	}
+}
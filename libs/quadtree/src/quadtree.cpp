@@ -5,29 +5,82 @@
 using pairf = std::pair<float, float>;
 
 float quadtree::distance(const std::pair<float, float> &a, const std::pair<float, float> &b) {
-	return (a.first - b.first) * (a.first - b.first) + (a.second - b.second) * (a.second - b.second);
+	return PointReducer::distance(a, b);
 }
 
 bool quadtree::inBounds(const pairf &data, const std::pair<pairf, pairf> &bounds) {
-	return data.first >= bounds.first.first && data.second >= bounds.first.second
-		&& data.first <= bounds.second.first && data.second <= bounds.second.second;
+	return PointReducer::inBounds(data, bounds);
 }
 
 float quadtree::minDistance(const pairf &point, const std::pair<pairf, pairf> &bounds) {
-	// Find the closest point and return the distance
-	pairf closestPoint = std::pair<float, float>(
-		clamp(point.first, bounds.first.first, bounds.second.first),
-		clamp(point.second, bounds.first.second, bounds.second.second)
-	);
-
-	return quadtree::distance(point, closestPoint);
+	return PointReducer::minDistance(point, bounds);
 }
 
-// Return the bounding box of child node i
 std::pair<pairf, pairf> quadtree::getBounds(const std::pair<pairf, pairf> &data, int i) {
-	pairf size((data.second.first - data.first.first) / 2.f, (data.second.second - data.first.second) / 2.f);
+	return PointReducer::getBounds(data, i);
+}
+
+float quadtree::mass(const pairf &data) {
+	return PointReducer::mass(data);
+}
+
+pairf quadtree::position(const pairf &data) {
+	return PointReducer::position(data);
+}
+
+// Spread the lower 16 bits of x so there is a zero between each of them
+static uint32_t spreadBits(uint32_t x) {
+	x = (x | (x << 8)) & 0x00ff00ff;
+	x = (x | (x << 4)) & 0x0f0f0f0f;
+	x = (x | (x << 2)) & 0x33333333;
+	x = (x | (x << 1)) & 0x55555555;
+	return x;
+}
+
+uint32_t quadtree::mortonCode(const pairf &position, const std::pair<pairf, pairf> &bounds) {
+	const float cells = (float)(1 << mortonDepth);
+	float x = (position.first - bounds.first.first) / (bounds.second.first - bounds.first.first) * cells;
+	float y = (position.second - bounds.first.second) / (bounds.second.second - bounds.first.second) * cells;
+
+	// Data outside the bounds is kept in the closest cell
+	uint32_t qx = (uint32_t)clamp(x, 0.f, cells - 1.f);
+	uint32_t qy = (uint32_t)clamp(y, 0.f, cells - 1.f);
+
+	return spreadBits(qx) | (spreadBits(qy) << 1);
+}
+
+void quadtree::sortByCode(std::vector<uint64_t> &keys, std::vector<uint64_t> &scratch) {
+	scratch.resize(keys.size());
+
+	// Every chunk of keys is counted and scattered by its own thread. Chunks are
+	// scattered in order so each pass stays stable
+	int chunks = threadCount();
+	size_t chunkSize = (keys.size() + chunks - 1) / chunks;
+	std::vector<std::array<size_t, 256>> offsets(chunks);
+
+	// Least significant digit first, 8 bits at a time
+	for (int shift = 32; shift < 64; shift += 8) {
+		#pragma omp parallel for
+		for (int c = 0; c < chunks; c++) {
+			offsets[c].fill(0);
+			size_t end = std::min(keys.size(), (c + 1) * chunkSize);
+			for (size_t i = c * chunkSize; i < end; i++) offsets[c][(keys[i] >> shift) & 0xff]++;
+		}
 
-	pairf start(size.first * (float)(i & 1) + data.first.first, size.second * (float)((i >> 1) & 1) + data.first.second);
+		size_t total = 0;
+		for (int digit = 0; digit < 256; digit++) {
+			for (int c = 0; c < chunks; c++) {
+				size_t count = offsets[c][digit];
+				offsets[c][digit] = total;
+				total += count;
+			}
+		}
 
-	return { { start.first, start.second }, { start.first + size.first, start.second + size.second } };
+		#pragma omp parallel for
+		for (int c = 0; c < chunks; c++) {
+			size_t end = std::min(keys.size(), (c + 1) * chunkSize);
+			for (size_t i = c * chunkSize; i < end; i++) scratch[offsets[c][(keys[i] >> shift) & 0xff]++] = keys[i];
+		}
+		keys.swap(scratch);
+	}
 }
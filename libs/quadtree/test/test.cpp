@@ -25,7 +25,12 @@ pairf *slowNearest(pairf point, vector<pairf*> points) {
 	return nearest;
 }
 
+// Reducers missing the mass and position methods shouldn't build
+using PointTreeReducer = TreeReducer<pairf, pair<pairf, pairf>>;
+static_assert(!is_constructible_v<PointTreeReducer, decltype(&quadtree::distance), decltype(&quadtree::inBounds), decltype(&quadtree::minDistance), decltype(&quadtree::getBounds)>);
+
 int main() {
+	int failures = 0;
 	QuadTree<> tree(80);
 	vector<pairf> points;
 
@@ -45,6 +50,20 @@ int main() {
 	chrono::duration<double> seconds = end - start;
 	cout << "Indexed in " << seconds.count() << "s" << endl;
 
+#if CHECK_ANSWERS
+	// Every point has unit mass so the root should hold all of them at their mean
+	pair<double, double> mean(0.0, 0.0);
+	for (auto &p : points) {
+		mean.first += p.first / points.size();
+		mean.second += p.second / points.size();
+	}
+	if (tree.root->mass != points.size() || fabs(tree.root->centerOfMass.first - mean.first) > 1e-3f
+			|| fabs(tree.root->centerOfMass.second - mean.second) > 1e-3f) {
+		cout << "Wrong root aggregate " << tree.root->mass << " at " << tree.root->centerOfMass.first << ", " << tree.root->centerOfMass.second << endl;
+		failures++;
+	}
+#endif
+
 	// Time moving each element
 	start = chrono::system_clock::now();
 	for (int i = 0; i < points.size(); i++) {
@@ -70,6 +89,25 @@ int main() {
 	seconds = end - start;
 	cout << "Reindexed in " << seconds.count() << "s" << endl;
 
+	// Move everything a little so only data near the edge of its leaf has to move
+	for (int i = 0; i < points.size(); i++) {
+		auto delta = points[points.size() - i - 1];
+		points[i].first += delta.first * 0.001f;
+		points[i].second += delta.second * 0.001f;
+	}
+	start = chrono::system_clock::now();
+	size_t moved = tree.reindexMoved();
+	end = chrono::system_clock::now();
+	seconds = end - start;
+	cout << "Reindexed " << moved << " moved in " << seconds.count() << "s" << endl;
+
+#if CHECK_ANSWERS
+	if (tree.root->leafCount != points.size() || tree.root->mass != points.size()) {
+		cout << "Wrong totals after moving " << tree.root->leafCount << ", " << tree.root->mass << endl;
+		failures++;
+	}
+#endif
+
 	chrono::duration<double> treeTime;
 	chrono::duration<double> slowTime;
 
@@ -83,6 +121,8 @@ int main() {
 		if (nearest != &points[i]) {
 			cout << "Wrong nearest on index " << i << endl;
 			cout << nearest->first << " vs " << points[i].first << ", " << nearest->second << ", " << points[i].second << endl;
+#pragma omp atomic
+			failures++;
 		}
 #endif
 	}
@@ -91,6 +131,143 @@ int main() {
 
 	cout << "Queried all in " << treeTime.count() << "s using tree" << endl;
 
+	// Same benchmark with the compile time reducer
+	QuadTree<pairf, pair<pairf, pairf>, 4, PointReducer> policyTree(80);
+	policyTree.initialize(points);
+	start = chrono::system_clock::now();
+#pragma omp parallel for
+	for (int i = 0; i < points.size(); i++) {
+		pairf const* nearest = policyTree.nearest(points[i]);
+
+#if CHECK_ANSWERS
+		if (nearest != &points[i]) {
+			cout << "Wrong nearest with PointReducer on index " << i << endl;
+#pragma omp atomic
+			failures++;
+		}
+#endif
+	}
+	end = chrono::system_clock::now();
+	treeTime = end - start;
+
+	cout << "              " << treeTime.count() << "s using PointReducer" << endl;
+
+	// Same benchmark answered as a batch into flat arrays
+	const int k = 4;
+	vector<uint32_t> ids(points.size() * k);
+	vector<float> distances(points.size() * k);
+	start = chrono::system_clock::now();
+	policyTree.nearest(points.data(), points.size(), 1, ids.data(), distances.data());
+	end = chrono::system_clock::now();
+	treeTime = end - start;
+
+	cout << "              " << treeTime.count() << "s as a batch" << endl;
+
+#if CHECK_ANSWERS
+	for (int i = 0; i < points.size(); i++) {
+		if (ids[i] != i) {
+			cout << "Wrong batch nearest on index " << i << endl;
+			failures++;
+		}
+	}
+
+	// The closest k should come back in order and match a slow search
+	policyTree.nearest(points.data(), 100, k, ids.data(), distances.data());
+	for (int i = 0; i < 100; i++) {
+		vector<float> slow;
+		for (auto &p : points) slow.push_back(distance(points[i], p));
+		sort(slow.begin(), slow.end());
+		// The batched distances may be rounded differently to the scalar ones
+		for (int j = 0; j < k; j++) {
+			float tolerance = slow[j] * 1e-5f;
+			if (fabs(distances[i * k + j] - slow[j]) > tolerance
+				|| fabs(distance(points[i], points[ids[i * k + j]]) - slow[j]) > tolerance) {
+				cout << "Wrong batch " << j << "th nearest on index " << i << endl;
+				failures++;
+			}
+		}
+	}
+#endif
+
+#if CHECK_ANSWERS
+	// The gravity kernel should match a plain loop whatever instruction set it uses
+	vector<float> xs, ys, ms;
+	for (int i = 0; i < 1001; i++) {
+		xs.push_back(points[i].first);
+		ys.push_back(points[i].second);
+		ms.push_back(1.f + i % 3);
+	}
+	float ax = 0.f, ay = 0.f;
+	kernels::gravity(xs[0], ys[0], xs.data(), ys.data(), ms.data(), xs.size(), 0.01f, ax, ay);
+	double expectedX = 0.0, expectedY = 0.0;
+	for (int i = 1; i < xs.size(); i++) {
+		double dx = xs[i] - xs[0], dy = ys[i] - ys[0];
+		double dist2 = dx * dx + dy * dy + 0.01;
+		expectedX += ms[i] * dx / (dist2 * sqrt(dist2));
+		expectedY += ms[i] * dy / (dist2 * sqrt(dist2));
+	}
+	if (fabs(ax - expectedX) > 1e-3 * fabs(expectedX) + 1e-3 || fabs(ay - expectedY) > 1e-3 * fabs(expectedY) + 1e-3) {
+		cout << "Wrong " << kernels::instructionSet() << " gravity " << ax << ", " << ay << " vs " << expectedX << ", " << expectedY << endl;
+		failures++;
+	}
+
+	// Data that moved since the aggregates were summed and is then removed should leave
+	// the aggregates matching the data that is left
+	vector<pairf> few(points.begin(), points.begin() + 5000);
+	QuadTree<pairf, pair<pairf, pairf>, 4, PointReducer> smallTree(16);
+	smallTree.initialize(few);
+	for (int i = 0; i < few.size(); i += 2) {
+		few[i].first = -few[i].first;
+		smallTree.remove(few[i]);
+	}
+	pair<double, double> rest(0.0, 0.0);
+	for (int i = 1; i < few.size(); i += 2) {
+		rest.first += few[i].first / (few.size() / 2);
+		rest.second += few[i].second / (few.size() / 2);
+	}
+	if (smallTree.root->leafCount != few.size() / 2 || smallTree.root->mass != few.size() / 2 || fabs(smallTree.root->centerOfMass.first - rest.first) > 1e-4f
+			|| fabs(smallTree.root->centerOfMass.second - rest.second) > 1e-4f) {
+		cout << "Wrong aggregate after removing " << smallTree.root->leafCount << ", " << smallTree.root->mass << " at " << smallTree.root->centerOfMass.first << ", " << smallTree.root->centerOfMass.second << endl;
+		failures++;
+	}
+
+	// Every count should match the data under it, and no container should be left
+	// with half a bin or less
+	vector<decltype(smallTree.root)> nodes = { smallTree.root };
+	while (nodes.size()) {
+		auto node = nodes.back();
+		nodes.pop_back();
+		int count = 0;
+		if (node->container) {
+			for (int j = 0; j < 4; j++) {
+				count += node->children[j].leafCount;
+				nodes.push_back(&node->children[j]);
+			}
+			if (node != smallTree.root && node->leafCount <= 8) {
+				cout << "Underfull container after removing with " << node->leafCount << endl;
+				failures++;
+			}
+		}
+		else count = node->values.size();
+		if (node->leafCount != count) {
+			cout << "Wrong count after removing " << node->leafCount << " vs " << count << endl;
+			failures++;
+		}
+	}
+
+	// Reverse the data and renumber the tree to match
+	reverse(points.begin(), points.end());
+	vector<uint32_t> newIds(points.size());
+	for (uint32_t i = 0; i < points.size(); i++) newIds[i] = points.size() - 1 - i;
+	policyTree.renumber(newIds);
+	for (int i = 0; i < points.size(); i += 97) {
+		if (policyTree.nearest(points[i]) != &points[i]) {
+			cout << "Wrong nearest after renumbering on index " << i << endl;
+			failures++;
+		}
+	}
+#endif
+
 
 	// Slow benchmark
 #if COMPARE_SLOW
@@ -114,5 +291,5 @@ int main() {
 	cout << "           and " << slowTime.count() << "s using loop" << endl;
 #endif
 
-	return 0;
+	return failures > 0;
 }
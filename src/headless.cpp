@@ -0,0 +1,325 @@
+// Runs the simulation without a window for benchmarks and batch runs
+#include "simulation.hpp"
+#include "snapshot.hpp"
+#include "splat.hpp"
+#include "trajectory.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+struct Options {
+	int bodies = 100000;
+	int steps = 100;
+	float time = 0.01f;
+	unsigned int seed = 1;
+	// Initial conditions to generate, disc or uniform
+	std::string scene = "disc";
+	// Text file with one body per line as x y vx vy mass radius, used instead of a scene
+	std::string load;
+	// Binary snapshot to map instead of generating a scene, and one to save at the end
+	std::string snapshot, save;
+	// Print diagnostics every this many steps, 0 for only the summary
+	int report = 10;
+	int threads = 0;
+
+	// Directory to write density images to, nothing is drawn if it's empty
+	std::string frames;
+	// Draw an image every this many steps
+	int frameEvery = 1;
+	int width = 1024, height = 1024;
+	// Half of the height of the area shown
+	float view = 1.f;
+	float exposure = 1.f;
+	// Draw tree nodes smaller than a pixel as one point instead of every body
+	bool lod = false;
+
+	// File to save every trajectoryEvery-th step to, nothing is saved if it's empty
+	std::string trajectory;
+	int trajectoryEvery = 1;
+	trajectory::Policy policy = trajectory::Policy::Drop;
+	// Steps that can wait to be written before the policy applies
+	int trajectoryBuffers = 4;
+	bool direct = false;
+};
+
+static void usage() {
+	std::cout << "Usage: nbody-headless [options]\n"
+		"  --bodies N          number of bodies to generate (100000)\n"
+		"  --scene disc|uniform initial conditions to generate (disc)\n"
+		"  --load FILE         read bodies as lines of x y vx vy mass radius instead\n"
+		"  --snapshot FILE     map a binary snapshot instead\n"
+		"  --save FILE         write a binary snapshot after the last step\n"
+		"  --seed N            random seed for the scene (1)\n"
+		"  --steps N           number of steps to run (100)\n"
+		"  --dt T              time per step (0.01)\n"
+		"  --integrator euler|leapfrog|yoshida (euler)\n"
+		"  --block             use block timesteps, which step with leapfrog\n"
+		"  --max-rung N        smallest timestep is dt / 2^N with --block (8)\n"
+		"  --theta T           Barnes-Hut opening angle (0.5)\n"
+		"  --gravity G         gravitational constant (0.001)\n"
+		"  --merge             merge colliding bodies instead of bouncing them\n"
+		"  --no-collide        don't handle collisions\n"
+		"  --report N          print diagnostics every N steps, 0 for none (10)\n"
+		"  --threads N         number of threads to use\n"
+		"  --frames DIR        write density images to DIR as PPM files\n"
+		"  --frame-every N     write an image every N steps (1)\n"
+		"  --size WxH          size of the images (1024x1024)\n"
+		"  --view H            half of the height of the area shown (1)\n"
+		"  --exposure E        brightness of faint regions in the images (1)\n"
+		"  --lod               draw tree nodes smaller than a pixel as one point\n"
+		"  --trajectory FILE   save steps to FILE from a background thread\n"
+		"  --trajectory-every N save every N steps (1)\n"
+		"  --policy block|drop|decimate what to do when the writer falls behind (drop)\n"
+		"  --buffers N         steps that can wait to be written (4)\n"
+		"  --direct            write the trajectory with O_DIRECT\n";
+}
+
+static bool parse(int argc, char **argv, Options &options, simulation::Simulation &sim) {
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		// Every option except the flags takes a value
+		auto value = [&]() -> const char* {
+			if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+			return argv[++i];
+		};
+
+		if (arg == "--bodies") {
+			options.bodies = std::stoi(value());
+			if (options.bodies <= 0) throw std::runtime_error("--bodies should be at least 1");
+		}
+		else if (arg == "--scene") options.scene = value();
+		else if (arg == "--load") options.load = value();
+		else if (arg == "--snapshot") options.snapshot = value();
+		else if (arg == "--save") options.save = value();
+		else if (arg == "--seed") options.seed = std::stoul(value());
+		else if (arg == "--steps") options.steps = std::stoi(value());
+		else if (arg == "--dt") options.time = std::stof(value());
+		else if (arg == "--integrator") {
+			std::string name = value();
+			if (name == "euler") sim.integrator = simulation::Integrator::Euler;
+			else if (name == "leapfrog") sim.integrator = simulation::Integrator::Leapfrog;
+			else if (name == "yoshida") sim.integrator = simulation::Integrator::Yoshida;
+			else throw std::runtime_error("Unknown integrator " + name);
+		}
+		else if (arg == "--block") {
+			sim.blockTimesteps = true;
+			sim.integrator = simulation::Integrator::Leapfrog;
+		}
+		else if (arg == "--max-rung") {
+			sim.maxRung = std::stoi(value());
+			if (sim.maxRung < 0 || sim.maxRung > 31) throw std::runtime_error("--max-rung should be from 0 to 31");
+		}
+		else if (arg == "--theta") sim.theta = std::stof(value());
+		else if (arg == "--gravity") sim.gravity = std::stof(value());
+		else if (arg == "--merge") sim.collisionMode = simulation::CollisionMode::Merge;
+		else if (arg == "--no-collide") sim.collide = false;
+		else if (arg == "--report") options.report = std::stoi(value());
+		else if (arg == "--threads") options.threads = std::stoi(value());
+		else if (arg == "--frames") options.frames = value();
+		else if (arg == "--frame-every") options.frameEvery = std::max(std::stoi(value()), 1);
+		else if (arg == "--size") {
+			std::string size = value();
+			size_t split = size.find('x');
+			if (split == std::string::npos) throw std::runtime_error("Size should look like 1024x768");
+			options.width = std::stoi(size.substr(0, split));
+			options.height = std::stoi(size.substr(split + 1));
+		}
+		else if (arg == "--view") options.view = std::stof(value());
+		else if (arg == "--exposure") options.exposure = std::stof(value());
+		else if (arg == "--lod") options.lod = true;
+		else if (arg == "--trajectory") options.trajectory = value();
+		else if (arg == "--trajectory-every") options.trajectoryEvery = std::max(std::stoi(value()), 1);
+		else if (arg == "--policy") {
+			std::string name = value();
+			if (name == "block") options.policy = trajectory::Policy::Block;
+			else if (name == "drop") options.policy = trajectory::Policy::Drop;
+			else if (name == "decimate") options.policy = trajectory::Policy::Decimate;
+			else throw std::runtime_error("Unknown policy " + name);
+		}
+		else if (arg == "--buffers") options.trajectoryBuffers = std::stoi(value());
+		else if (arg == "--direct") options.direct = true;
+		else if (arg == "--help" || arg == "-h") {
+			usage();
+			return false;
+		}
+		else throw std::runtime_error("Unknown option " + arg);
+	}
+	return true;
+}
+
+static void generate(const Options &options, simulation::Simulation &sim) {
+	std::mt19937 random(options.seed);
+	std::uniform_real_distribution<float> unit(0.f, 1.f);
+	float mass = 1.f / options.bodies;
+	float radius = 0.1f / sqrtf(options.bodies);
+
+	for (int i = 0; i < options.bodies; i++) {
+		simulation::Body body = { .radius = radius, .mass = mass };
+		if (options.scene == "uniform") {
+			body.position = { unit(random) * 2.f - 1.f, unit(random) * 2.f - 1.f };
+			body.velocity = { 0.f, 0.f };
+		}
+		else if (options.scene == "disc") {
+			// Bodies orbit the center at the speed that balances the gravity of the mass inside
+			float distance = sqrtf(unit(random)) * 0.9f + 0.05f;
+			float angle = unit(random) * 2.f * (float)M_PI;
+			float inside = (distance - 0.05f) / 0.9f;
+			float speed = sqrtf(sim.gravity * inside * inside * distance / (distance * distance + sim.softening));
+			body.position = { cosf(angle) * distance, sinf(angle) * distance };
+			body.velocity = { -sinf(angle) * speed, cosf(angle) * speed };
+		}
+		else throw std::runtime_error("Unknown scene " + options.scene);
+		sim.addBody(body);
+	}
+}
+
+static void load(const std::string &path, simulation::Simulation &sim) {
+	std::ifstream file(path);
+	if (!file) throw std::runtime_error("Can't open " + path);
+	simulation::Body body;
+	while (file >> body.position.first >> body.position.second >> body.velocity.first >> body.velocity.second >> body.mass >> body.radius) {
+		sim.addBody(body);
+	}
+}
+
+// Draw the bodies into the renderer and write the image for a step
+static void drawFrame(const Options &options, int step, const simulation::Simulation &sim, splat::Renderer &renderer,
+		std::vector<float> &positions, std::vector<float> &attributes) {
+	renderer.clear();
+	if (options.lod) {
+		sim.writeLevelOfDetail(2.f * options.view / options.height, positions, attributes);
+		renderer.add(positions.data(), positions.data() + 1, attributes.data() + 1, positions.size() / 2, 2);
+	}
+	else {
+		const simulation::BodyStore &bodies = sim.getBodies();
+		renderer.add(bodies.x.data(), bodies.y.data(), bodies.mass.data(), bodies.size());
+	}
+	renderer.toneMap();
+
+	char name[32];
+	snprintf(name, sizeof(name), "/frame%06d.ppm", step);
+	if (!renderer.writePPM(options.frames + name)) std::cerr << "Can't write " << options.frames + name << std::endl;
+}
+
+// Totals that should be conserved, to check the accuracy of a run
+static void diagnostics(int step, double elapsed, const simulation::Simulation &sim) {
+	const simulation::BodyStore &bodies = sim.getBodies();
+	int n = bodies.size();
+	double mass = 0.0, momentumX = 0.0, momentumY = 0.0, kinetic = 0.0;
+	#pragma omp parallel for reduction(+:mass, momentumX, momentumY, kinetic)
+	for (int i = 0; i < n; i++) {
+		mass += bodies.mass[i];
+		momentumX += bodies.mass[i] * bodies.vx[i];
+		momentumY += bodies.mass[i] * bodies.vy[i];
+		kinetic += 0.5 * bodies.mass[i] * (bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+	}
+
+	std::cout << "step " << step << "  " << elapsed * 1e3 << "ms  bodies " << n
+		<< "  collisions " << sim.getCollisions().size() << "  mass " << mass
+		<< "  momentum " << momentumX << ", " << momentumY << "  kinetic " << kinetic << std::endl;
+}
+
+int main(int argc, char **argv) {
+	Options options;
+	simulation::Simulation sim;
+	try {
+		if (!parse(argc, argv, options, sim)) return 0;
+#ifdef _OPENMP
+		if (options.threads > 0) omp_set_num_threads(options.threads);
+#endif
+		if (options.snapshot.size()) sim.setBodies(snapshot::load(options.snapshot));
+		else if (options.load.size()) load(options.load, sim);
+		else generate(options, sim);
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		usage();
+		return 1;
+	}
+
+	std::cout << sim.getBodies().size() << " bodies, " << options.steps << " steps of " << options.time << std::endl;
+	diagnostics(0, 0.0, sim);
+
+	splat::Renderer renderer(options.width, options.height);
+	renderer.halfHeight = options.view;
+	renderer.exposure = options.exposure;
+	std::vector<float> positions, attributes;
+
+	std::unique_ptr<trajectory::Writer> writer;
+	if (options.trajectory.size()) {
+		try {
+			writer = std::make_unique<trajectory::Writer>(options.trajectory, options.trajectoryEvery, options.policy, options.trajectoryBuffers, options.direct);
+		}
+		catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		if (options.direct && !writer->isDirect()) std::cerr << "O_DIRECT isn't supported for " << options.trajectory << ", using the page cache" << std::endl;
+	}
+
+	using clock = std::chrono::steady_clock;
+	double total = 0.0, fastest = INFINITY, slowest = 0.0, drawing = 0.0, saving = 0.0;
+	int frames = 0;
+	if (options.frames.size()) drawFrame(options, 0, sim, renderer, positions, attributes);
+	for (int step = 1; step <= options.steps; step++) {
+		auto start = clock::now();
+		sim.step(options.time);
+		std::chrono::duration<double> elapsed = clock::now() - start;
+
+		total += elapsed.count();
+		fastest = std::min(fastest, elapsed.count());
+		slowest = std::max(slowest, elapsed.count());
+		if (options.report > 0 && step % options.report == 0) diagnostics(step, elapsed.count(), sim);
+
+		// Only the copy into the writer's buffer is paid for here, it's written in the background
+		if (writer) {
+			start = clock::now();
+			writer->offer(sim, step);
+			saving += std::chrono::duration<double>(clock::now() - start).count();
+		}
+
+		if (options.frames.size() && step % options.frameEvery == 0) {
+			start = clock::now();
+			drawFrame(options, step, sim, renderer, positions, attributes);
+			drawing += std::chrono::duration<double>(clock::now() - start).count();
+			frames++;
+		}
+	}
+
+	// Nothing to time without steps
+	if (total > 0.0) {
+		std::cout << "Ran " << options.steps << " steps in " << total << "s, " << total / options.steps * 1e3 << "ms per step (min "
+			<< fastest * 1e3 << "ms, max " << slowest * 1e3 << "ms), "
+			<< sim.getBodies().size() * options.steps / total << " body steps per second" << std::endl;
+	}
+	if (frames) std::cout << "Drew " << frames << " images in " << drawing << "s, " << drawing / frames * 1e3 << "ms per image" << std::endl;
+	if (writer) {
+		// Finish writing before counting what was written
+		writer->close();
+		trajectory::Stats stats = writer->getStats();
+		std::cout << "Copied " << stats.offered - stats.dropped << " steps for the trajectory in " << saving << "s, wrote "
+			<< stats.written << " (" << stats.bytes / 1e6 << "MB), dropped " << stats.dropped << ", blocked " << stats.blocked
+			<< " times, decimated " << stats.decimated << " times to every " << stats.interval << " steps";
+		if (stats.failed) std::cout << ", " << stats.failed << " writes failed";
+		std::cout << std::endl;
+	}
+
+	if (options.save.size()) {
+		try {
+			snapshot::save(options.save, sim.getBodies());
+		}
+		catch (const std::exception &e) {
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+	}
+	return 0;
+}
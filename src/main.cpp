@@ -2,61 +2,122 @@
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #include "simulation.hpp"
+#include "snapshot.hpp"
 #include "shaders.hpp"
 #include "app.hpp"
+#include "triple_buffer.hpp"
+#include "stream_buffer.hpp"
+#include <atomic>
+#include <thread>
 
 GLFWwindow* window;
 int width, height;
 
-bool running = true;
+std::atomic<bool> running = true;
 
 void errorCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam) {
 	std::cerr << "GL CALLBACK: " << (type == GL_DEBUG_TYPE_ERROR ? "DEBUG ERROR" : "") << " type = " << type << " severity = " << severity << " message = " << message << std::endl;
 }
 
+// A finished step. Positions are sent every frame, radius and mass only when the layout
+// of the bodies changed
+struct Frame {
+	std::vector<float> positions;
+	std::vector<float> attributes;
+	uint64_t layout = 0;
+};
+
 simulation::Simulation sim;
-GLuint pointsBuffer, pointArray;
+// The simulation runs on its own thread and publishes every finished step here
+TripleBuffer<Frame> frames;
+std::thread simThread;
+
+GLuint pointArray;
+// Positions are streamed through a persistently mapped ring, radius and mass live in their own buffer
+StreamBuffer positionsBuffer;
+GLuint attributesBuffer;
+// Layout of the attributes in attributesBuffer
+uint64_t uploadedLayout = 0;
+// Number of bodies in the last frame uploaded
+size_t frameSize = 0;
 shaders::circleShader circleDrawer;
+// Draw instanced quads instead of geometry shader circles, pass --geometry to turn off
+bool useQuads = true;
+// Tree nodes smaller than this many pixels are drawn as one sprite, set with --lod. 0 draws every body
+float lodPixels = 0.f;
+// lodPixels in simulation units for the current window size, read by the simulation thread
+std::atomic<float> lodSize = 0.f;
+// Binary snapshot to start from, set with --snapshot. The default scene is used without one
+std::string snapshotPath;
+
+void bindCircleDrawer(shaders::circleShader, GLuint);
+void upload(const Frame &frame);
+
+// Fill the back frame from the simulation. Every slot keeps its own attributes so they
+// only have to be copied when that slot is behind the simulation's layout
+static void writeFrame(Frame &frame) {
+	if (lodPixels > 0.f) {
+		// The sprites are different every frame so the attributes always have to be sent
+		static uint64_t lodFrame = 0;
+		sim.writeLevelOfDetail(lodSize, frame.positions, frame.attributes);
+		frame.layout = ++lodFrame | 1ull << 63;
+		return;
+	}
 
-void bindCircleDrawer(shaders::circleShader, GLuint, GLuint);
+	sim.writePositions(frame.positions);
+	if (frame.layout != sim.getLayout()) {
+		sim.writeAttributes(frame.attributes);
+		frame.layout = sim.getLayout();
+	}
+}
 
 static GLFWwindow* setup() {
-	for (int i = -5; i < 5; i++) {
-		simulation::Body body = { .position = {.5f, (float)i / 5.f}, .radius = 0.05f, .mass = 0.05f, .velocity = {0.01f, 0.f} };
-		sim.addBody(body);
+	if (snapshotPath.size()) sim.setBodies(snapshot::load(snapshotPath));
+	else {
+		for (int i = -5; i < 5; i++) {
+			simulation::Body body = { .position = {.5f, (float)i / 5.f}, .radius = 0.05f, .mass = 0.05f, .velocity = {0.01f, 0.f} };
+			sim.addBody(body);
+		}
 	}
 
 	window = createWindow(480, 360, "NBody");
 	glEnable(GL_DEBUG_OUTPUT);
 	glDebugMessageCallback(errorCallback, 0);
 
-	glGenVertexArrays(1, &pointArray);
-	glBindVertexArray(pointArray);
+	glCreateVertexArrays(1, &pointArray);
+	glCreateBuffers(1, &attributesBuffer);
 
-	glGenBuffers(1, &pointsBuffer);
-	glBindBuffer(GL_ARRAY_BUFFER, pointsBuffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(simulation::Body) * sim.getData().size(), &sim.getData()[0], GL_DYNAMIC_DRAW);
+	circleDrawer = shaders::compileCircleShader(useQuads);
+	bindCircleDrawer(circleDrawer, pointArray);
 
-	glBindVertexBuffer(0, pointsBuffer, 0, sizeof(simulation::Body));
+	Frame first;
+	writeFrame(first);
+	upload(first);
 
-	circleDrawer = shaders::compileCircleShader();
-	bindCircleDrawer(circleDrawer, pointArray, pointsBuffer);
+	// Step as fast as possible instead of once per frame. The renderer shows whichever
+	// step finished last
+	simThread = std::thread([]() {
+		while (running) {
+			sim.step(0.1f);
+			writeFrame(frames.back());
+			frames.publish();
+		}
+	});
 
 	return window;
 }
 
 static bool draw() {
 	//std::cout << "Error: " << glGetError() << std::endl;
-	sim.step(0.1f);
-	glBindBuffer(GL_ARRAY_BUFFER, pointsBuffer);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(simulation::Body) * sim.getData().size(), &sim.getData()[0]);
+	if (frames.acquire()) upload(frames.front());
 
 	glfwGetFramebufferSize(window, &width, &height);
+	// The camera maps a unit of the simulation to a quarter of the smaller side in pixels
+	if (lodPixels > 0.f) lodSize = lodPixels * 4.f / std::max(std::min(width, height), 1);
 	glViewport(0, 0, width, height);
 	glClearColor(0.f, 0.f, 0.f, 0.f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	glBindBuffer(GL_ARRAY_BUFFER, pointsBuffer);
 	glm::mat4 camera({
 		{(float)std::min(width, height) / (float)width, 0.f, 0.f, 0.f},
 		{0.f, (float)std::min(width, height) / (float)height, 0.f, 0.f},
@@ -66,7 +127,10 @@ static bool draw() {
 
 	glUniformMatrix4fv(circleDrawer.transformLocation, 1, GL_FALSE, glm::value_ptr((camera)));
 	glUseProgram(circleDrawer.program);
-	glDrawArrays(GL_POINTS, 0, sim.getData().size());
+	glBindVertexArray(pointArray);
+	if (useQuads) glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, frameSize);
+	else glDrawArrays(GL_POINTS, 0, frameSize);
+	positionsBuffer.fence();
 
 	return running;
 }
@@ -83,28 +147,55 @@ static void cursorPosCb(GLFWwindow *window, double xpos, double ypos) {
 	
 }
 
-void bindCircleDrawer(shaders::circleShader shader, GLuint arr, GLuint buffer) {
-	glBindVertexArray(arr);
-	glBindBuffer(GL_ARRAY_BUFFER, buffer);
-	
-	glEnableVertexAttribArray(circleDrawer.positionLocation);
-	std::cout << "Error: " << glGetError() << std::endl;
-	glVertexAttribPointer(circleDrawer.positionLocation, 2, GL_FLOAT, GL_FALSE, sizeof(simulation::Body), (void*)0);
-	std::cout << "Error: " << glGetError() << std::endl;
+void upload(const Frame &frame) {
+	frameSize = frame.positions.size() / 2;
+	size_t size = frame.positions.size() * sizeof(float);
+	if (size == 0) return;
+
+	// Bodies can be added, so grow the ring with some room to spare when a frame doesn't fit
+	if (size > positionsBuffer.capacity()) positionsBuffer.allocate(size * 2);
+	GLintptr offset = positionsBuffer.write(frame.positions.data(), size);
+	glVertexArrayVertexBuffer(pointArray, 0, positionsBuffer.getBuffer(), offset, sizeof(float) * 2);
 
-	glEnableVertexAttribArray(circleDrawer.radiusLocation);
-	std::cout << "Error: " << glGetError() << std::endl;
-	glVertexAttribPointer(circleDrawer.radiusLocation, 1, GL_FLOAT, GL_FALSE, sizeof(simulation::Body), (void*)(sizeof(float) * 2));
-	std::cout << "Error: " << glGetError() << std::endl;
+	if (frame.layout != uploadedLayout) {
+		glNamedBufferData(attributesBuffer, frame.attributes.size() * sizeof(float), frame.attributes.data(), GL_DYNAMIC_DRAW);
+		uploadedLayout = frame.layout;
+	}
+}
+
+void bindCircleDrawer(shaders::circleShader shader, GLuint arr) {
+	// Binding 0 holds positions and binding 1 holds radius and mass pairs
+	glEnableVertexArrayAttrib(arr, shader.positionLocation);
+	glVertexArrayAttribFormat(arr, shader.positionLocation, 2, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(arr, shader.positionLocation, 0);
+
+	glEnableVertexArrayAttrib(arr, shader.radiusLocation);
+	glVertexArrayAttribFormat(arr, shader.radiusLocation, 1, GL_FLOAT, GL_FALSE, 0);
+	glVertexArrayAttribBinding(arr, shader.radiusLocation, 1);
+
+	glEnableVertexArrayAttrib(arr, shader.massLocation);
+	glVertexArrayAttribFormat(arr, shader.massLocation, 1, GL_FLOAT, GL_FALSE, sizeof(float));
+	glVertexArrayAttribBinding(arr, shader.massLocation, 1);
 
-	glEnableVertexAttribArray(circleDrawer.massLocation);
-	std::cout << "Error: " << glGetError() << std::endl;
-	glVertexAttribPointer(circleDrawer.massLocation, 1, GL_FLOAT, GL_FALSE, sizeof(simulation::Body), (void*)(sizeof(float) * 3));
-	std::cout << "Error: " << glGetError() << std::endl;
+	glVertexArrayVertexBuffer(arr, 1, attributesBuffer, 0, sizeof(float) * 2);
 
+	// Quads are drawn as instances of four vertices, with the attributes advancing per instance
+	if (useQuads) {
+		glVertexArrayBindingDivisor(arr, 0, 1);
+		glVertexArrayBindingDivisor(arr, 1, 1);
+	}
 }
 
-int main() {
+int main(int argc, char **argv) {
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--geometry") useQuads = false;
+		if (std::string(argv[i]) == "--lod" && i + 1 < argc) lodPixels = std::stof(argv[++i]);
+		if (std::string(argv[i]) == "--snapshot" && i + 1 < argc) snapshotPath = argv[++i];
+	}
+
 	App app(&setup, &draw, &keyCb, &clickCb, &cursorPosCb);
 	app.start();
+
+	running = false;
+	if (simThread.joinable()) simThread.join();
 }
@@ -66,6 +66,37 @@ void main() {
 })glsl";
 
 
+// One quad per body drawn with instancing. The disc is cut out of the quad in the fragment
+// shader, which is much cheaper than emitting triangles from a geometry shader
+static const char* quadVertexShaderText = R"glsl(
+#version 450
+layout(location=0) in vec2 position;
+layout(location=1) in float radius_in;
+layout(location=2) in float mass_in;
+
+uniform mat4 transform;
+
+out vec2 corner;
+out float mass;
+
+void main() {
+	corner = vec2((gl_VertexID & 1) * 2 - 1, (gl_VertexID >> 1) * 2 - 1);
+	// Same placement as the geometry shader circles
+	gl_Position = transform * vec4(position, 0.0, 1.0) + transform * vec4(corner * radius_in, 0.0, 1.0);
+	mass = mass_in;
+};)glsl";
+
+static const char* quadFragShaderText = R"glsl(
+#version 450
+out vec4 FragColor;
+in vec2 corner;
+in float mass;
+void main() {
+	if (dot(corner, corner) > 1.0) discard;
+	FragColor = vec4(mass, 1.0, 0.0, 1.0);
+};)glsl";
+
+
 inline GLuint getShader(GLuint type, const char* text) {
 	std::cout << "Compiling shader" << std::endl;
 	GLuint outShader = glCreateShader(type);
@@ -87,23 +118,24 @@ inline GLuint getShader(GLuint type, const char* text) {
 	return outShader;
 }
 
+// Either renderer. geomShader is 0 for the quad renderer
 struct circleShader {
 	GLuint program, vertShader, fragShader, geomShader;
 	GLuint positionLocation, radiusLocation, massLocation;
 	GLuint transformLocation;
 };
 
-inline circleShader compileCircleShader() {
+inline circleShader compileCircleShader(bool quads=false) {
 	circleShader out;
 
-	out.vertShader = getShader(GL_VERTEX_SHADER, vertexShaderText);
-	out.fragShader = getShader(GL_FRAGMENT_SHADER, fragShaderText);
-	out.geomShader = getShader(GL_GEOMETRY_SHADER, geomShaderText);
+	out.vertShader = getShader(GL_VERTEX_SHADER, quads ? quadVertexShaderText : vertexShaderText);
+	out.fragShader = getShader(GL_FRAGMENT_SHADER, quads ? quadFragShaderText : fragShaderText);
+	out.geomShader = quads ? 0 : getShader(GL_GEOMETRY_SHADER, geomShaderText);
 
 	out.program = glCreateProgram();
 	glAttachShader(out.program, out.vertShader);
 	glAttachShader(out.program, out.fragShader);
-	glAttachShader(out.program, out.geomShader);
+	if (out.geomShader) glAttachShader(out.program, out.geomShader);
 	glLinkProgram(out.program);
 	char* log = new char[1000];
 	int len;
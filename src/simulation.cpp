@@ -1,54 +1,528 @@
 #include "simulation.hpp"
 #include "quadtree/quadtree.hpp"
+#include "quadtree/kernels.hpp"
 #include <algorithm>
-#include <stack>
 #include <memory>
+#include <numeric>
 
-float simulation::distance(const Body &a, const Body &b) {
-	float A = (a.position.first - b.position.first);
-	float B = (a.position.second - b.position.second);
-	return std::max(A * A + B * B - a.radius * a.radius - b.radius * b.radius, 0.f);
+void simulation::Simulation::step(float time) {
+	switch (integrator) {
+		case Integrator::Euler:
+			drift(time);
+			updateForces();
+			kick(time);
+			break;
+		case Integrator::Leapfrog:
+			if (blockTimesteps) blockLeapfrog(time);
+			else leapfrog(time);
+			break;
+		case Integrator::Yoshida: {
+			// Three leapfrog steps whose errors cancel up to fourth order
+			const float w1 = 1.f / (2.f - cbrtf(2.f)), w0 = 1.f - 2.f * w1;
+			leapfrog(w1 * time);
+			leapfrog(w0 * time);
+			leapfrog(w1 * time);
+			break;
+		}
+	}
+	dataChanged = true;
+
+	if (collide) {
+		findCollisions();
+		if (collisionMode == CollisionMode::Merge) mergeCollisions();
+		else resolveCollisions();
+	}
 }
 
-bool simulation::inBounds(const Body &x, const Bounds &b) {
-	return quadtree::inBounds(x.position, b);
+void simulation::Simulation::leapfrog(float time) {
+	// The forces from the end of the last step are still valid unless bodies were changed
+	if (!forcesValid) updateForces();
+	kick(time * 0.5f);
+	drift(time);
+	updateForces();
+	kick(time * 0.5f);
 }
 
-float simulation::minDistance(const Body &x, const Bounds &b) {
-	return quadtree::minDistance(x.position, b) - x.radius * x.radius;
+void simulation::Simulation::blockLeapfrog(float time) {
+	if (!forcesValid) updateForces();
+	int n = bodies.size();
+	// Ticks are counted in 32 bits
+	maxRung = std::clamp(maxRung, 0, 31);
+	uint32_t ticks = 1u << maxRung;
+	float tickTime = time / ticks;
+
+	// Every body starts a step together
+	assignRungs(time, 0);
+	kickRungs(time, 0);
+
+	uint32_t tick = 0;
+	while (tick < ticks) {
+		// The next tick is where the steps on the highest rung in use end
+		// Sorting the bodies swaps the arrays, so don't keep pointers across force passes
+		const uint8_t *rung = bodies.rung.data();
+		int top = 0;
+		#pragma omp parallel for reduction(max:top)
+		for (int i = 0; i < n; i++) top = std::max(top, (int)rung[i]);
+		uint32_t period = ticks >> top;
+		uint32_t next = (tick / period + 1) * period;
+		drift((next - tick) * tickTime);
+		tick = next;
+
+		// Bodies on rung r end a step on every multiple of ticks / 2^r
+		int minRung = tick == ticks ? 0 : maxRung - __builtin_ctz(tick);
+		updateForces(minRung);
+		kickRungs(time, minRung);
+		// Steps all end together so velocities line up with positions for collisions
+		if (tick < ticks) {
+			assignRungs(time, minRung);
+			kickRungs(time, minRung);
+		}
+	}
 }
 
-void simulation::Simulation::step(float time, int maxCollisions) {
+void simulation::Simulation::kickRungs(float time, int minRung) {
+	int n = bodies.size();
+	float *vx = bodies.vx.data(), *vy = bodies.vy.data();
+	const float *ax = bodies.ax.data(), *ay = bodies.ay.data();
+	const uint8_t *rung = bodies.rung.data();
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		float half = rung[i] >= minRung ? ldexpf(time, -rung[i] - 1) : 0.f;
+		vx[i] += ax[i] * half;
+		vy[i] += ay[i] * half;
+	}
+}
+
+void simulation::Simulation::assignRungs(float time, int minRung) {
+	int n = bodies.size();
+	const float *ax = bodies.ax.data(), *ay = bodies.ay.data();
+	uint8_t *rung = bodies.rung.data();
+	float length = sqrtf(softening);
 	#pragma omp parallel for
-	for (int i = 0; i < data.size(); i++) {
-		data[i].position.first += data[i].velocity.first * time;
-		data[i].position.second += data[i].velocity.second * time;
+	for (int i = 0; i < n; i++) {
+		if (rung[i] < minRung) continue;
+		float acceleration = sqrtf(ax[i] * ax[i] + ay[i] * ay[i]);
+		float timestep = timestepAccuracy * sqrtf(length / acceleration);
+		int wanted;
+		// Nothing pulls on the body so any step will do
+		if (acceleration == 0.f) wanted = 0;
+		// Steps shorter than the smallest one, including the zero or NaN steps of zero
+		// softening or an infinite acceleration, take the smallest one
+		else if (!(timestep > ldexpf(time, -maxRung))) wanted = maxRung;
+		else wanted = timestep >= time ? 0 : (int)ceilf(log2f(time / timestep));
+		rung[i] = std::clamp(wanted, minRung, maxRung);
 	}
-	points.reindex();
+}
 
+void simulation::Simulation::drift(float time) {
+	int n = bodies.size();
+	float *x = bodies.x.data(), *y = bodies.y.data();
+	const float *vx = bodies.vx.data(), *vy = bodies.vy.data();
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		x[i] += vx[i] * time;
+		y[i] += vy[i] * time;
+	}
+}
 
-	// Check for collisions between bodies and handle them
-	// TODO: Allow for multiple collisions per body
-	/*#pragma omp parallel for
-	for (int i = 0; i < data.size(); i++) {
-		auto nearest = *points.nearest(data[i], 1).begin();
-		if (nearest.first <= 0.f) collisions[i] = nearest.second;
-		else collisions[i] = nullptr;
+void simulation::Simulation::kick(float time) {
+	int n = bodies.size();
+	float *vx = bodies.vx.data(), *vy = bodies.vy.data();
+	const float *ax = bodies.ax.data(), *ay = bodies.ay.data();
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		vx[i] += ax[i] * time;
+		vy[i] += ay[i] * time;
 	}
+}
 
-	// TODO: It is more efficient to reindex the entire tree if there are many collisions.
-	// 		 This should be handled efficiently
-	// TODO: Parallelize handleCollision. It might be as simple as making every body property atomic.
-	for (int i = 0; i < data.size(); i++) {
-		if (collisions[i]) handleCollision(&data[i], collisions[i]);
-	}*/
+void simulation::Simulation::updateForces(int minRung) {
+	indexBodies();
+	applyGravity(minRung);
+	forcesValid = true;
 }
 
-void simulation::Simulation::handleCollision(Body *a, Body *b) {
-	// Do nothing for now
+void simulation::Simulation::findCollisions() {
+	int n = bodies.size();
+	const float *x = bodies.x.data(), *y = bodies.y.data(), *radius = bodies.radius.data();
+	if (pairBuffers.size() < quadtree::threadCount()) pairBuffers.resize(quadtree::threadCount());
+	// A team smaller than on an earlier step leaves some buffers unused, so clear them all
+	for (auto &pairs : pairBuffers) pairs.clear();
+
+	#pragma omp parallel
+	{
+		auto &pairs = pairBuffers[quadtree::threadIndex()];
+		std::vector<const Tree::Node*> stack;
+
+		// Static scheduling gives every thread a contiguous run of bodies, so joining the
+		// buffers in thread order lists the pairs in body order
+		#pragma omp for schedule(static)
+		for (int i = 0; i < n; i++) {
+			// A pair is found by its larger body, which overlaps the other only if their
+			// centers are within twice its radius. BodyReducer::minDistance subtracts the
+			// squared radius, so that is 4r^2 - r^2
+			float r = radius[i];
+			points.within(i, 3.f * r * r, [&](uint32_t j) {
+				if (radius[j] > r || (radius[j] == r && j <= i)) return;
+				float dx = x[j] - x[i], dy = y[j] - y[i];
+				float reach = r + radius[j];
+				if (dx * dx + dy * dy < reach * reach) pairs.emplace_back(i, j);
+			}, stack);
+		}
+	}
+
+	collisions.clear();
+	for (auto &pairs : pairBuffers) collisions.insert(collisions.end(), pairs.begin(), pairs.end());
+}
+
+void simulation::Simulation::resolveCollisions() {
+	// Give every pair the lowest batch that neither of its bodies is in yet. This is serial
+	// and only depends on the order of the pairs, so the batches are the same on any number
+	// of threads. Pairs whose bodies are already in every batch go in a last one
+	const int lastBatch = 64;
+	batchMasks.assign(bodies.size(), 0);
+	pairBatches.resize(collisions.size());
+	batchStarts.assign(lastBatch + 2, 0);
+	for (size_t i = 0; i < collisions.size(); i++) {
+		auto pair = collisions[i];
+		uint64_t used = batchMasks[pair.first] | batchMasks[pair.second];
+		int batch = ~used ? __builtin_ctzll(~used) : lastBatch;
+		if (batch < lastBatch) {
+			batchMasks[pair.first] |= 1ull << batch;
+			batchMasks[pair.second] |= 1ull << batch;
+		}
+		pairBatches[i] = batch;
+		batchStarts[batch + 1]++;
+	}
+
+	// Sort the pairs into their batches, keeping their order within each one
+	for (int batch = 0; batch <= lastBatch; batch++) batchStarts[batch + 1] += batchStarts[batch];
+	batched.resize(collisions.size());
+	for (size_t i = 0; i < collisions.size(); i++) batched[batchStarts[pairBatches[i]]++] = collisions[i];
+	for (int batch = lastBatch; batch > 0; batch--) batchStarts[batch] = batchStarts[batch - 1];
+	batchStarts[0] = 0;
+
+	// No body is in a batch twice so its pairs can be resolved in any order
+	#pragma omp parallel
+	for (int batch = 0; batch < lastBatch; batch++) {
+		#pragma omp for schedule(static)
+		for (uint32_t i = batchStarts[batch]; i < batchStarts[batch + 1]; i++) {
+			handleCollision(batched[i].first, batched[i].second);
+		}
+	}
+	for (uint32_t i = batchStarts[lastBatch]; i < batchStarts[lastBatch + 1]; i++) {
+		handleCollision(batched[i].first, batched[i].second);
+	}
+}
+
+void simulation::Simulation::mergeCollisions() {
+	if (collisions.empty()) return;
+
+	// Join touching bodies into groups, each led by its lowest id
+	mergedInto.resize(bodies.size());
+	merged.clear();
+	for (auto &pair : collisions) {
+		merged.push_back(pair.first);
+		merged.push_back(pair.second);
+		mergedInto[pair.first] = pair.first;
+		mergedInto[pair.second] = pair.second;
+	}
+	auto find = [&](uint32_t i) {
+		while (mergedInto[i] != i) i = mergedInto[i] = mergedInto[mergedInto[i]];
+		return i;
+	};
+	for (auto &pair : collisions) {
+		uint32_t a = find(pair.first), b = find(pair.second);
+		if (a < b) mergedInto[b] = a;
+		else if (b < a) mergedInto[a] = b;
+	}
+
+	// Add every other body to the leader of its group in id order, which always comes
+	// after the leader. Mass and momentum are conserved and the areas are added
+	std::sort(merged.begin(), merged.end());
+	merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+	removed.assign(bodies.size(), false);
+	for (uint32_t i : merged) {
+		uint32_t leader = find(i);
+		if (leader == i) continue;
+		float ma = bodies.mass[leader], mb = bodies.mass[i], total = ma + mb;
+		bodies.x[leader] = (bodies.x[leader] * ma + bodies.x[i] * mb) / total;
+		bodies.y[leader] = (bodies.y[leader] * ma + bodies.y[i] * mb) / total;
+		bodies.vx[leader] = (bodies.vx[leader] * ma + bodies.vx[i] * mb) / total;
+		bodies.vy[leader] = (bodies.vy[leader] * ma + bodies.vy[i] * mb) / total;
+		bodies.radius[leader] = sqrtf(bodies.radius[leader] * bodies.radius[leader] + bodies.radius[i] * bodies.radius[i]);
+		bodies.mass[leader] = total;
+		removed[i] = true;
+	}
+
+	// Remove every merged body at once. The order of the rest is kept so the store stays
+	// sorted, and the tree is rebuilt over the smaller store on the next step
+	bodies.compact(removed);
+	ids.resize(bodies.size());
+	treeStale = true;
+	forcesValid = false;
+	layout++;
+}
+
+void simulation::Simulation::handleCollision(uint32_t a, uint32_t b) {
+	// Elastic collision along the line between the centers
+	float nx = bodies.x[b] - bodies.x[a], ny = bodies.y[b] - bodies.y[a];
+	float length = sqrtf(nx * nx + ny * ny);
+	if (length <= 0.f) return;
+	nx /= length;
+	ny /= length;
+
+	// Bodies that are already separating are left alone so a pair doesn't stick together
+	float approach = (bodies.vx[b] - bodies.vx[a]) * nx + (bodies.vy[b] - bodies.vy[a]) * ny;
+	if (approach >= 0.f) return;
+
+	float ma = bodies.mass[a], mb = bodies.mass[b];
+	float impulse = -2.f * approach / (1.f / ma + 1.f / mb);
+	bodies.vx[a] -= impulse / ma * nx;
+	bodies.vy[a] -= impulse / ma * ny;
+	bodies.vx[b] += impulse / mb * nx;
+	bodies.vy[b] += impulse / mb * ny;
 }
 
 void simulation::Simulation::addBody(Body &point) {
-	data.push_back(point);
-	points.insert(point, points.root);
+	// The tree is rebuilt from the store on the next step
+	ids.push_back(bodies.size());
+	bodies.push(point);
+	dataChanged = true;
+	// New bodies are at the end of the store wherever they are, so sort on the next step.
+	// ids may have been reallocated so the tree has to be rebuilt either way
+	stepsSinceReorder = reorderInterval;
+	treeStale = true;
+	forcesValid = false;
+	layout++;
+}
+
+void simulation::Simulation::setBodies(BodyStore &&store) {
+	// Moving keeps the address of the store the tree's reducer points at
+	bodies = std::move(store);
+	if (bodies.id.empty()) {
+		bodies.id.resize(bodies.size());
+		std::iota(bodies.id.begin(), bodies.id.end(), 0u);
+		bodies.nextId = bodies.size();
+	}
+	ids.resize(bodies.size());
+	std::iota(ids.begin(), ids.end(), 0u);
+	dataChanged = true;
+	// Sorting right away would copy every borrowed array. Saved stores are usually still
+	// close to the tree's order, so wait for the usual interval
+	stepsSinceReorder = 0;
+	treeStale = true;
+	forcesValid = false;
+	layout++;
+}
+
+const std::vector<simulation::Body> &simulation::Simulation::getData() {
+	if (dataChanged) {
+		writeData(data);
+		dataChanged = false;
+	}
+	return data;
+}
+
+void simulation::Simulation::writeData(std::vector<Body> &out) const {
+	out.resize(bodies.size());
+	#pragma omp parallel for
+	for (int i = 0; i < out.size(); i++) out[i] = bodies.get(i);
+}
+
+void simulation::Simulation::writePositions(std::vector<float> &out) const {
+	int n = bodies.size();
+	out.resize(n * 2);
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		out[i * 2] = bodies.x[i];
+		out[i * 2 + 1] = bodies.y[i];
+	}
+}
+
+void simulation::Simulation::writeAttributes(std::vector<float> &out) const {
+	int n = bodies.size();
+	out.resize(n * 2);
+	#pragma omp parallel for simd
+	for (int i = 0; i < n; i++) {
+		out[i * 2] = bodies.radius[i];
+		out[i * 2 + 1] = bodies.mass[i];
+	}
+}
+
+void simulation::Simulation::writeLevelOfDetail(float minSize, std::vector<float> &positions, std::vector<float> &attributes) const {
+	if (treeStale || points.dataLocations.size() != bodies.size()) {
+		writePositions(positions);
+		writeAttributes(attributes);
+		return;
+	}
+
+	positions.clear();
+	attributes.clear();
+	std::vector<const Tree::Node*> stack = { points.root };
+	while (stack.size()) {
+		const Tree::Node *node = stack.back();
+		stack.pop_back();
+		float size = node->bounds.second.first - node->bounds.first.first;
+
+		if (size < minSize && node != points.root) {
+			if (node->mass <= 0.f) continue;
+			positions.push_back(node->centerOfMass.first);
+			positions.push_back(node->centerOfMass.second);
+			attributes.push_back(size * 0.5f);
+			attributes.push_back(node->mass);
+		}
+		else if (node->container) {
+			for (int i = 0; i < 4; i++) stack.push_back(&node->children[i]);
+		}
+		else for (uint32_t id : node->values) {
+			positions.push_back(bodies.x[id]);
+			positions.push_back(bodies.y[id]);
+			attributes.push_back(bodies.radius[id]);
+			attributes.push_back(bodies.mass[id]);
+		}
+	}
+}
+
+void simulation::Simulation::indexBodies() {
+	bool reorder = reorderInterval > 0 && ++stepsSinceReorder >= reorderInterval;
+	Bounds bounds = getBounds();
+	const Bounds &root = points.rootBounds;
+	bool inRoot = bounds.first.first >= root.first.first && bounds.first.second >= root.first.second
+		&& bounds.second.first <= root.second.first && bounds.second.second <= root.second.second;
+
+	if (incrementalIndex && !treeStale && !reorder && inRoot) {
+		points.reindexMoved();
+		return;
+	}
+
+	// Rebuild the tree. The root is made a bit larger in incremental mode so bodies
+	// can drift for a while before it has to be rebuilt again
+	points.rootBounds = incrementalIndex ? getBounds(0.1f) : bounds;
+	points.initialize(ids);
+	treeStale = false;
+	if (reorder) {
+		reorderBodies();
+		stepsSinceReorder = 0;
+	}
+}
+
+void simulation::Simulation::reorderBodies() {
+	// initialize leaves the keys sorted by Morton code with the id in the lower bits,
+	// so the leaves already hold contiguous runs of the new order
+	int n = bodies.size();
+	if (points.keys.size() != n) return;
+	order.resize(n);
+	newIds.resize(n);
+	#pragma omp parallel for
+	for (int i = 0; i < n; i++) {
+		order[i] = (uint32_t)points.keys[i];
+		newIds[order[i]] = i;
+	}
+
+	bodies.permute(order, reorderScratch);
+	points.renumber(newIds);
+	layout++;
+}
+
+simulation::Bounds simulation::Simulation::getBounds(float margin) const {
+	if (bodies.size() == 0) return Bounds{ {-1.f, -1.f}, {1.f, 1.f} };
+
+	int n = bodies.size();
+	const float *x = bodies.x.data(), *y = bodies.y.data();
+	float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+	#pragma omp parallel for simd reduction(min:minX, minY) reduction(max:maxX, maxY)
+	for (int i = 0; i < n; i++) {
+		minX = std::min(minX, x[i]);
+		minY = std::min(minY, y[i]);
+		maxX = std::max(maxX, x[i]);
+		maxY = std::max(maxY, y[i]);
+	}
+
+	// Use a square so that the size of a node is the same along both axes
+	// and pad it so bodies on the edge are still inside the children
+	float size = std::max(maxX - minX, maxY - minY) * 0.5f * (1.f + margin) + 1e-3f;
+	float centerX = (minX + maxX) * 0.5f, centerY = (minY + maxY) * 0.5f;
+	return Bounds{ {centerX - size, centerY - size}, {centerX + size, centerY + size} };
+}
+
+void simulation::Simulation::applyGravity(int minRung) {
+	using Node = Tree::Node;
+	float theta2 = theta * theta;
+	const float *x = bodies.x.data(), *y = bodies.y.data(), *mass = bodies.mass.data();
+	float *ax = bodies.ax.data(), *ay = bodies.ay.data();
+
+	leaves.clear();
+	std::vector<const Node*> stack = { points.root };
+	while (stack.size()) {
+		const Node *node = stack.back();
+		stack.pop_back();
+		if (node->container) for (int j = 0; j < 4; j++) stack.push_back(&node->children[j]);
+		else if (node->values.size()) leaves.push_back(node);
+	}
+	// Only walk the tree for leaves with a body that needs new forces
+	const uint8_t *rung = bodies.rung.data();
+	if (minRung > 0) {
+		leaves.erase(std::remove_if(leaves.begin(), leaves.end(), [&](const Node *leaf) {
+			for (uint32_t id : leaf->values) if (rung[id] >= minRung) return false;
+			return true;
+		}), leaves.end());
+	}
+
+	#pragma omp parallel
+	{
+		std::vector<const Node*> stack;
+		// Positions and masses of everything acting on the current leaf
+		FloatArray listX, listY, listMass;
+
+		#pragma omp for schedule(dynamic, 16)
+		for (int l = 0; l < leaves.size(); l++) {
+			const Node *leaf = leaves[l];
+			listX.clear();
+			listY.clear();
+			listMass.clear();
+
+			stack.clear();
+			stack.push_back(points.root);
+			while (stack.size()) {
+				const Node *node = stack.back();
+				stack.pop_back();
+				if (node->mass <= 0.f) continue;
+
+				// A node is far enough away if it is small compared to its distance to the
+				// closest point of the leaf, so the approximation holds for every body in it.
+				// Nodes are either nested or disjoint, so a node overlapping the leaf contains
+				// it and its aggregate includes the leaf's own bodies. Those are always opened
+				float dist2 = quadtree::PointReducer::minDistance(node->centerOfMass, leaf->bounds);
+				float size = node->bounds.second.first - node->bounds.first.first;
+				bool disjoint = node->bounds.second.first <= leaf->bounds.first.first || node->bounds.first.first >= leaf->bounds.second.first
+					|| node->bounds.second.second <= leaf->bounds.first.second || node->bounds.first.second >= leaf->bounds.second.second;
+
+				if (disjoint && size * size < theta2 * dist2) {
+					listX.push_back(node->centerOfMass.first);
+					listY.push_back(node->centerOfMass.second);
+					listMass.push_back(node->mass);
+				}
+				else if (node->container) {
+					for (int j = 0; j < 4; j++) stack.push_back(&node->children[j]);
+				}
+				else {
+					// Bodies of the leaf itself are included, the kernel skips each body's own position
+					for (uint32_t id : node->values) {
+						listX.push_back(x[id]);
+						listY.push_back(y[id]);
+						listMass.push_back(mass[id]);
+					}
+				}
+			}
+
+			for (uint32_t id : leaf->values) {
+				if (rung[id] < minRung) continue;
+				float sumX = 0.f, sumY = 0.f;
+				quadtree::kernels::gravity(x[id], y[id], listX.data(), listY.data(), listMass.data(), listX.size(), softening, sumX, sumY);
+				ax[id] = gravity * sumX;
+				ay[id] = gravity * sumY;
+			}
+		}
+	}
 }
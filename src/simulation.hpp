@@ -1,9 +1,11 @@
+#pragma once
 #include <quadtree/quadtree.hpp>
+#include <algorithm>
+#include <memory>
 #include <vector>
+#include <new>
 #include <unordered_map>
 
-#define MAX_BODIES 100000
-
 namespace simulation {
 	struct Body {
 		std::pair<float, float> position;
@@ -13,30 +15,397 @@ namespace simulation {
 
 	using Bounds = std::pair<std::pair<float, float>, std::pair<float, float>>;
 
-	float distance(const Body &a, const Body &b);
-	bool inBounds(const Body &x, const Bounds &b);
-	float minDistance(const Body &x, const Bounds &b);
+	// Allocates arrays on cache line boundaries so they can be loaded with aligned SIMD loads
+	template<class T, size_t alignment = 64>
+	struct AlignedAllocator {
+		using value_type = T;
+		template<class U> struct rebind { using other = AlignedAllocator<U, alignment>; };
+
+		AlignedAllocator() = default;
+		template<class U> AlignedAllocator(const AlignedAllocator<U, alignment> &) {}
+
+		T* allocate(size_t n) {
+			return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignment)));
+		}
+		void deallocate(T* p, size_t) {
+			::operator delete(p, std::align_val_t(alignment));
+		}
+
+		bool operator==(const AlignedAllocator &) const { return true; }
+		bool operator!=(const AlignedAllocator &) const { return false; }
+	};
+
+	// Floats on cache line boundaries with the parts of std::vector the simulation uses. The
+	// memory is either allocated or borrowed, like a column of a mapped snapshot, in which
+	// case owner keeps it alive until the array grows past it
+	class FloatArray {
+		public:
+			FloatArray() = default;
+			FloatArray(const FloatArray &other) {
+				*this = other;
+			}
+			FloatArray(FloatArray &&other) noexcept {
+				swap(other);
+			}
+			~FloatArray() {
+				release();
+			}
+
+			FloatArray &operator=(const FloatArray &other) {
+				if (this == &other) return *this;
+				count = 0;
+				reserve(other.count);
+				std::copy(other.values, other.values + other.count, values);
+				count = other.count;
+				return *this;
+			}
+			FloatArray &operator=(FloatArray &&other) noexcept {
+				swap(other);
+				return *this;
+			}
+
+			size_t size() const {
+				return count;
+			}
+			bool empty() const {
+				return count == 0;
+			}
+			float *data() {
+				return values;
+			}
+			const float *data() const {
+				return values;
+			}
+			float &operator[](size_t i) {
+				return values[i];
+			}
+			const float &operator[](size_t i) const {
+				return values[i];
+			}
+			float *begin() {
+				return values;
+			}
+			float *end() {
+				return values + count;
+			}
+			const float *begin() const {
+				return values;
+			}
+			const float *end() const {
+				return values + count;
+			}
+
+			void clear() {
+				count = 0;
+			}
+			void push_back(float value) {
+				if (count == capacity) reserve(std::max<size_t>(capacity * 2, 16));
+				values[count++] = value;
+			}
+			// New elements are zero
+			void resize(size_t n) {
+				reserve(n);
+				if (n > count) std::fill(values + count, values + n, 0.f);
+				count = n;
+			}
+			void reserve(size_t n) {
+				if (n <= capacity) return;
+				float *grown = AlignedAllocator<float>().allocate(n);
+				std::copy(values, values + count, grown);
+				size_t kept = count;
+				release();
+				values = grown;
+				count = kept;
+				capacity = n;
+			}
+			void swap(FloatArray &other) noexcept {
+				std::swap(values, other.values);
+				std::swap(count, other.count);
+				std::swap(capacity, other.capacity);
+				std::swap(owner, other.owner);
+			}
+
+			// Use n floats at memory without copying them. memory has to be aligned like
+			// allocated arrays and stay valid while owner is alive
+			void borrow(float *memory, size_t n, std::shared_ptr<void> memoryOwner) {
+				release();
+				values = memory;
+				count = capacity = n;
+				owner = std::move(memoryOwner);
+			}
+			bool borrowed() const {
+				return owner != nullptr;
+			}
+
+		private:
+			void release() {
+				if (owner) owner.reset();
+				else if (values) AlignedAllocator<float>().deallocate(values, capacity);
+				values = nullptr;
+				count = capacity = 0;
+			}
+
+			float *values = nullptr;
+			size_t count = 0, capacity = 0;
+			std::shared_ptr<void> owner;
+	};
+
+	// Every property of the bodies in its own array so the update loops and force kernels
+	// only touch the fields they need and vectorize
+	struct BodyStore {
+		FloatArray x, y, vx, vy, mass, radius;
+		// Acceleration from the last force pass
+		FloatArray ax, ay;
+		// Timestep rung of each body. A body on rung r moves in steps of 1 / 2^r of a step
+		std::vector<uint8_t> rung;
+		// Id of each body, which stays with it when the store is sorted or compacted
+		std::vector<uint32_t> id;
+		// Id the next pushed body gets
+		uint32_t nextId = 0;
+
+		size_t size() const {
+			return x.size();
+		}
+
+		void push(const Body &body) {
+			x.push_back(body.position.first);
+			y.push_back(body.position.second);
+			vx.push_back(body.velocity.first);
+			vy.push_back(body.velocity.second);
+			mass.push_back(body.mass);
+			radius.push_back(body.radius);
+			ax.push_back(0.f);
+			ay.push_back(0.f);
+			rung.push_back(0);
+			id.push_back(nextId++);
+		}
+
+		Body get(size_t i) const {
+			return { .position = {x[i], y[i]}, .radius = radius[i], .mass = mass[i], .velocity = {vx[i], vy[i]} };
+		}
+
+		// Remove the bodies flagged in removed, keeping the order of the rest
+		void compact(const std::vector<bool> &removed) {
+			size_t count = 0;
+			for (size_t i = 0; i < size(); i++) {
+				if (removed[i]) continue;
+				x[count] = x[i];
+				y[count] = y[i];
+				vx[count] = vx[i];
+				vy[count] = vy[i];
+				mass[count] = mass[i];
+				radius[count] = radius[i];
+				ax[count] = ax[i];
+				ay[count] = ay[i];
+				rung[count] = rung[i];
+				id[count] = id[i];
+				count++;
+			}
+			for (FloatArray *array : { &x, &y, &vx, &vy, &mass, &radius, &ax, &ay }) array->resize(count);
+			rung.resize(count);
+			id.resize(count);
+		}
+
+		// Move the body at order[i] to i in every array
+		void permute(const std::vector<uint32_t> &order, FloatArray &scratch) {
+			for (FloatArray *array : { &x, &y, &vx, &vy, &mass, &radius, &ax, &ay }) {
+				scratch.resize(order.size());
+				#pragma omp parallel for
+				for (size_t i = 0; i < order.size(); i++) scratch[i] = (*array)[order[i]];
+				array->swap(scratch);
+			}
+
+			std::vector<uint8_t> rungs(order.size());
+			#pragma omp parallel for
+			for (size_t i = 0; i < order.size(); i++) rungs[i] = rung[order[i]];
+			rung.swap(rungs);
+
+			std::vector<uint32_t> ids(order.size());
+			#pragma omp parallel for
+			for (size_t i = 0; i < order.size(); i++) ids[i] = id[order[i]];
+			id.swap(ids);
+		}
+	};
+
+	// Tree policy for bodies. The tree stores body ids and this reads their properties
+	// from the store. It is defined here so the tree can inline every call
+	struct BodyReducer {
+		const BodyStore *bodies = nullptr;
+
+		float distance(uint32_t a, uint32_t b) const {
+			float A = bodies->x[a] - bodies->x[b];
+			float B = bodies->y[a] - bodies->y[b];
+			return std::max(A * A + B * B - bodies->radius[a] * bodies->radius[a] - bodies->radius[b] * bodies->radius[b], 0.f);
+		}
+
+		bool inBounds(uint32_t i, const Bounds &b) const {
+			return quadtree::PointReducer::inBounds(position(i), b);
+		}
+
+		float minDistance(uint32_t i, const Bounds &b) const {
+			return quadtree::PointReducer::minDistance(position(i), b) - bodies->radius[i] * bodies->radius[i];
+		}
+
+		static Bounds getBounds(const Bounds &parent, int i) {
+			return quadtree::PointReducer::getBounds(parent, i);
+		}
+
+		float mass(uint32_t i) const {
+			return bodies->mass[i];
+		}
+
+		std::pair<float, float> position(uint32_t i) const {
+			return { bodies->x[i], bodies->y[i] };
+		}
+	};
+
+	enum class Integrator {
+		// Move every body and then accelerate it with the new forces
+		Euler,
+		// Kick-drift-kick leapfrog. Second order and symplectic, with one force pass per step
+		Leapfrog,
+		// Yoshida's fourth order composition of three leapfrog steps, with three force passes
+		Yoshida
+	};
+
+	enum class CollisionMode {
+		// Bodies bounce off each other elastically
+		Bounce,
+		// Touching bodies merge into one with their total mass, momentum and area
+		Merge
+	};
 
 	class Simulation {
 		public:
-			// Max collisions is the number of collisions that can be handled per body
-			void step(float time, int maxCollisions=5);
+			void step(float time);
 			void addBody(Body &point);
-			const std::vector<Body> &getData() {
-				return data;
+			// Replace every body with the ones in store, which may borrow its arrays from a
+			// mapped snapshot. Every array of the store has to have the same size, except id,
+			// which is numbered in store order when it's empty. The bodies
+			// aren't sorted until reorderInterval force passes later, so arrays the steps don't
+			// write to stay borrowed until then
+			void setBodies(BodyStore &&store);
+			const BodyStore &getBodies() const {
+				return bodies;
+			}
+			// Pairs of overlapping bodies found in the last step. The first body of a
+			// pair is the larger one. Ids are from before any merges
+			const std::vector<std::pair<uint32_t, uint32_t>> &getCollisions() const {
+				return collisions;
 			}
+			// Bodies as an array of structures for the renderer. It is only copied out of
+			// the store after something changed
+			const std::vector<Body> &getData();
+			// Copy the bodies into out as an array of structures, reusing its memory
+			void writeData(std::vector<Body> &out) const;
+			// Copy the positions of the bodies into out as x, y pairs
+			void writePositions(std::vector<float> &out) const;
+			// Copy the radius and mass of the bodies into out as pairs. These only change
+			// when the layout does
+			void writeAttributes(std::vector<float> &out) const;
+			// Write sprites like writePositions and writeAttributes, except that every node of
+			// the tree smaller than minSize is drawn as one sprite with its total mass at its
+			// center of mass. Writes every body if the tree is out of date
+			void writeLevelOfDetail(float minSize, std::vector<float> &positions, std::vector<float> &attributes) const;
+			// Changes whenever bodies are added, removed, reordered or resized
+			uint64_t getLayout() const {
+				return layout;
+			}
+
+			// Opening angle for Barnes-Hut. Nodes whose size divided by their distance
+			// is below theta are treated as a single body at their center of mass
+			float theta = 0.5f;
+			float gravity = 0.001f;
+			// Added to the squared distance between bodies to keep close encounters finite
+			float softening = 0.01f;
+			// Bodies are sorted along the Morton curve of the tree every this many force passes so
+			// bodies that are close in space are close in memory. 0 turns it off.
+			// Body indices are not stable across a reorder, BodyStore::id is
+			int reorderInterval = 16;
+			// Only move bodies that left their leaf each step instead of rebuilding the tree.
+			// The tree is still rebuilt when bodies leave the root or are sorted
+			bool incrementalIndex = true;
+			// Find and resolve overlapping bodies every step
+			bool collide = true;
+			CollisionMode collisionMode = CollisionMode::Bounce;
+			// Euler stays the default so existing runs behave the same
+			Integrator integrator = Integrator::Euler;
+
+			// Give every body its own power of two fraction of the step with the leapfrog
+			// integrator. Only the bodies finishing a substep get new forces, the rest only drift
+			bool blockTimesteps = false;
+			// Smallest timestep is the step divided by 2^maxRung. Clamped to 0 to 31
+			int maxRung = 8;
+			// Bodies take steps of about timestepAccuracy * sqrt(softening length / acceleration)
+			float timestepAccuracy = 0.1f;
 
 		private:
-			const quadtree::TreeReducer<Body, Bounds> reducer{
-				.distance = distance, 
-				.inBounds = inBounds, 
-				.minDistance = minDistance, 
-				.getBounds = quadtree::getBounds 
-			};
-			quadtree::QuadTree<Body> points = quadtree::QuadTree<Body>(4, Bounds{ {-1.f, -1.f}, {1.f, 1.f} }, reducer);
+			BodyStore bodies;
+			// The tree indexes ids[i] == i so the elements it points at are body ids
+			std::vector<uint32_t> ids;
+			using Tree = quadtree::QuadTree<uint32_t, Bounds, 4, BodyReducer>;
+			// Leaves share one interaction list so larger bins mean fewer tree walks
+			Tree points = Tree(32, Bounds{ {-1.f, -1.f}, {1.f, 1.f} }, BodyReducer{ &bodies });
+			// Leaves of the tree that hold bodies, found at the start of every force pass
+			std::vector<const Tree::Node*> leaves;
+
+			// Steps since the bodies were last sorted, and buffers for the sort
+			int stepsSinceReorder = 0;
+			std::vector<uint32_t> order, newIds;
+			FloatArray reorderScratch;
+
 			std::vector<Body> data;
-			void handleCollision(Body *a, Body *b);
+			bool dataChanged = true;
+			uint64_t layout = 0;
+			// Set when bodies were added or removed so the tree has to be rebuilt
+			bool treeStale = true;
+			// Every overlapping pair of bodies, found in parallel with one tree query per body
+			std::vector<std::pair<uint32_t, uint32_t>> collisions;
+			std::vector<std::vector<std::pair<uint32_t, uint32_t>>> pairBuffers;
+			void findCollisions();
+			// Resolve the collisions in batches where no body appears twice. Each batch is
+			// resolved in parallel and the result doesn't depend on the number of threads
+			void resolveCollisions();
+			// Batches each body is in as bits, the batch of each pair and the pairs sorted by batch
+			std::vector<uint64_t> batchMasks;
+			std::vector<uint8_t> pairBatches;
+			std::vector<uint32_t> batchStarts;
+			std::vector<std::pair<uint32_t, uint32_t>> batched;
+			void handleCollision(uint32_t a, uint32_t b);
+			// Merge every group of touching bodies into its lowest id and remove the rest
+			// from the store in one pass
+			void mergeCollisions();
+			// Group each body was merged into, the bodies in any collision and the bodies to remove
+			std::vector<uint32_t> mergedInto, merged;
+			std::vector<bool> removed;
+
+			// Fit the root of the tree around every body so none are out of bounds. margin is
+			// the fraction of the size added to every side
+			Bounds getBounds(float margin=0.f) const;
+			// Update the tree after the bodies moved, rebuilding and sorting it when needed
+			void indexBodies();
+			// Sort the bodies in the order of the tree's Morton keys and renumber the tree
+			void reorderBodies();
+			// Find the acceleration of every body from the gravity of every other body using
+			// the tree. The tree is walked once per leaf and the resulting interaction list is
+			// applied to every body in the leaf with a SIMD kernel
+			void applyGravity(int minRung=0);
+			// Index the bodies and find the accelerations of those on minRung and above
+			void updateForces(int minRung=0);
+			// Set when the accelerations in the store match the current bodies
+			bool forcesValid = false;
 
-			Body *collisions[MAX_BODIES];
+			// Move the bodies by their velocity and accelerate them by the last forces
+			void drift(float time);
+			void kick(float time);
+			// One kick-drift-kick step, reusing the forces from the end of the last one
+			void leapfrog(float time);
+			// Leapfrog with block timesteps. Steps are counted in ticks of the smallest timestep
+			void blockLeapfrog(float time);
+			// Kick the bodies on minRung and above by half of their own timestep
+			void kickRungs(float time, int minRung);
+			// Move the bodies on minRung and above to the rung their acceleration needs,
+			// staying on minRung or above so every step ends on a tick the others share
+			void assignRungs(float time, int minRung);
 	};
 }
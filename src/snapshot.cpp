@@ -0,0 +1,147 @@
+#include "snapshot.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+	// Columns start on multiples of this so mapped columns are aligned for SIMD loads
+	constexpr uint64_t pageSize = 4096;
+	// Reads back as something else on a machine with the other byte order
+	constexpr uint32_t byteOrderMark = 0x01020304;
+	constexpr char magic[8] = { 'N', 'B', 'O', 'D', 'Y', 'S', 'N', 'P' };
+
+	enum ColumnType : uint32_t {
+		Float32 = 1
+	};
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint64_t count;
+		uint32_t columns;
+		uint32_t reserved[9];
+	};
+	static_assert(sizeof(Header) == 64);
+
+	struct Column {
+		char name[16];
+		uint32_t type;
+		uint32_t reserved;
+		uint64_t offset;
+	};
+	static_assert(sizeof(Column) == 32);
+
+	// Every column of the store that is saved, in the order they are written
+	struct ColumnField {
+		const char *name;
+		simulation::FloatArray simulation::BodyStore::*array;
+	};
+	constexpr ColumnField fields[] = {
+		{ "x", &simulation::BodyStore::x },
+		{ "y", &simulation::BodyStore::y },
+		{ "vx", &simulation::BodyStore::vx },
+		{ "vy", &simulation::BodyStore::vy },
+		{ "mass", &simulation::BodyStore::mass },
+		{ "radius", &simulation::BodyStore::radius }
+	};
+	constexpr uint32_t fieldCount = sizeof(fields) / sizeof(fields[0]);
+
+	uint64_t alignToPage(uint64_t offset) {
+		return (offset + pageSize - 1) / pageSize * pageSize;
+	}
+}
+
+void snapshot::save(const std::string &path, const simulation::BodyStore &bodies) {
+	Header header = {};
+	std::memcpy(header.magic, magic, sizeof(magic));
+	header.version = version;
+	header.byteOrder = byteOrderMark;
+	header.count = bodies.size();
+	header.columns = fieldCount;
+
+	Column columns[fieldCount] = {};
+	uint64_t offset = alignToPage(sizeof(Header) + sizeof(columns));
+	for (uint32_t i = 0; i < fieldCount; i++) {
+		std::strncpy(columns[i].name, fields[i].name, sizeof(columns[i].name) - 1);
+		columns[i].type = Float32;
+		columns[i].offset = offset;
+		offset = alignToPage(offset + header.count * sizeof(float));
+	}
+
+	// The store may be borrowing its columns from a mapping of path, and truncating a mapped
+	// file drops its pages. Write a new file next to it and rename it over path instead, so
+	// the mapping keeps the old one until it's released
+	std::string temporary = path + ".tmp";
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	if (!file) throw std::runtime_error("Can't open " + temporary);
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(columns), sizeof(columns));
+
+	// Each column goes out in one write, with zeros up to the start of the next one
+	static const char padding[pageSize] = {};
+	for (uint32_t i = 0; i < fieldCount; i++) {
+		file.write(padding, columns[i].offset - file.tellp());
+		const simulation::FloatArray &array = bodies.*fields[i].array;
+		file.write(reinterpret_cast<const char*>(array.data()), array.size() * sizeof(float));
+	}
+	file.write(padding, offset - file.tellp());
+	file.close();
+	if (!file || std::rename(temporary.c_str(), path.c_str()) != 0) {
+		std::remove(temporary.c_str());
+		throw std::runtime_error("Can't write " + path);
+	}
+}
+
+simulation::BodyStore snapshot::load(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) throw std::runtime_error("Can't open " + path);
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Header)) {
+		close(fd);
+		throw std::runtime_error(path + " is too small to be a snapshot");
+	}
+
+	// Private so the simulation can write to the columns without changing the file. The
+	// mapping stays valid after the descriptor is closed
+	size_t size = info.st_size;
+	void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) throw std::runtime_error("Can't map " + path);
+	std::shared_ptr<void> mapping(mapped, [size](void *memory) { munmap(memory, size); });
+	char *base = static_cast<char*>(mapped);
+
+	const Header &header = *reinterpret_cast<const Header*>(base);
+	if (std::memcmp(header.magic, magic, sizeof(magic)) != 0) throw std::runtime_error(path + " isn't a snapshot");
+	if (header.byteOrder != byteOrderMark) throw std::runtime_error(path + " has a byte order this machine doesn't use");
+	if (header.version != version) throw std::runtime_error(path + " is version " + std::to_string(header.version) + ", expected " + std::to_string(version));
+	if (sizeof(Header) + header.columns * sizeof(Column) > size) throw std::runtime_error(path + " is truncated");
+	const Column *columns = reinterpret_cast<const Column*>(base + sizeof(Header));
+
+	simulation::BodyStore bodies;
+	uint64_t count = header.count;
+	for (const ColumnField &field : fields) {
+		// Unknown columns are skipped so newer files with more columns still load
+		const Column *column = nullptr;
+		for (uint32_t i = 0; i < header.columns && !column; i++) {
+			if (strncmp(columns[i].name, field.name, sizeof(columns[i].name)) == 0) column = &columns[i];
+		}
+		if (!column) throw std::runtime_error(path + " has no " + field.name + " column");
+		if (column->type != Float32) throw std::runtime_error(path + " has an unknown type for " + field.name);
+		if (column->offset % pageSize != 0) throw std::runtime_error(path + " has an unaligned " + field.name + " column");
+		if (column->offset > size || count > (size - column->offset) / sizeof(float)) throw std::runtime_error(path + " is truncated");
+		(bodies.*field.array).borrow(reinterpret_cast<float*>(base + column->offset), count, mapping);
+	}
+
+	// Accelerations and rungs aren't saved, the simulation finds them before the first step.
+	// Ids aren't either, so setBodies numbers the bodies in file order
+	bodies.ax.resize(count);
+	bodies.ay.resize(count);
+	bodies.rung.assign(count, 0);
+	return bodies;
+}
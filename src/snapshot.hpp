@@ -0,0 +1,26 @@
+#pragma once
+#include "simulation.hpp"
+#include <string>
+
+// Binary snapshots of the bodies. A snapshot is a header, a table of columns and then
+// every column as a little-endian array, each starting on a page boundary:
+//
+//   Header       magic, version, byte order mark, number of bodies and of columns
+//   Column[]     name, type and offset of every column in the file
+//   data         x, y, vx, vy, mass, radius as float32, padded to pages
+//
+// Columns are found by name so columns can be added without breaking older readers, and
+// the version only changes when the layout of the header or table does. Loading maps the
+// file and borrows the columns as the arrays of the body store, so nothing is parsed or
+// copied and pages are only read from disk when the simulation first touches them
+namespace snapshot {
+	constexpr uint32_t version = 1;
+
+	// Write the bodies to a new file and rename it over path, so a store loaded from path
+	// can be saved back to it. Throws std::runtime_error if the file can't be written
+	void save(const std::string &path, const simulation::BodyStore &bodies);
+	// Map the snapshot at path and return a store whose columns point into it. The mapping
+	// is private, so changing the bodies never changes the file. Throws std::runtime_error
+	// if the file can't be read or isn't a snapshot this version understands
+	simulation::BodyStore load(const std::string &path);
+}
@@ -0,0 +1,94 @@
+#include "splat.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+splat::Renderer::Renderer(int width, int height) : width(width), height(height), density(width * height), pixels(width * height * 3) {}
+
+void splat::Renderer::clear() {
+	std::fill(density.begin(), density.end(), 0.f);
+}
+
+void splat::Renderer::add(const float *x, const float *y, const float *mass, size_t n, int stride) {
+#ifdef _OPENMP
+	int threads = omp_get_max_threads();
+#else
+	int threads = 1;
+#endif
+	if (threadDensity.size() < threads) threadDensity.resize(threads);
+
+	// Pixels per unit of the simulation, and the simulation coordinates of pixel 0, 0
+	float scale = height * 0.5f / halfHeight;
+	float left = centerX - width * 0.5f / scale, top = centerY + halfHeight;
+	size_t size = density.size();
+	int used = 1;
+
+	// Every thread adds its share of the bodies to its own image so no pixel is written
+	// by two threads, then the images are summed
+	#pragma omp parallel num_threads(threads)
+	{
+#ifdef _OPENMP
+		std::vector<float> &image = threadDensity[omp_get_thread_num()];
+		#pragma omp single nowait
+		used = omp_get_num_threads();
+#else
+		std::vector<float> &image = threadDensity[0];
+#endif
+		image.assign(size, 0.f);
+
+		#pragma omp for schedule(static)
+		for (size_t i = 0; i < n; i++) {
+			// Pixel centers are at half coordinates, the body is split between the four around it
+			float px = (x[i * stride] - left) * scale - 0.5f;
+			float py = (top - y[i * stride]) * scale - 0.5f;
+			if (!(px > -1.f && py > -1.f && px < width && py < height)) continue;
+			int ix = (int)floorf(px), iy = (int)floorf(py);
+			float fx = px - ix, fy = py - iy;
+			float m = mass[i * stride];
+
+			float weights[4] = { (1.f - fx) * (1.f - fy), fx * (1.f - fy), (1.f - fx) * fy, fx * fy };
+			for (int corner = 0; corner < 4; corner++) {
+				int cx = ix + (corner & 1), cy = iy + (corner >> 1);
+				if (cx < 0 || cy < 0 || cx >= width || cy >= height) continue;
+				image[cy * width + cx] += m * weights[corner];
+			}
+		}
+
+		#pragma omp for schedule(static)
+		for (size_t p = 0; p < size; p++) {
+			float sum = 0.f;
+			for (int t = 0; t < used; t++) sum += threadDensity[t][p];
+			density[p] += sum;
+		}
+	}
+}
+
+void splat::Renderer::toneMap() {
+	float densest = 0.f;
+	size_t size = density.size();
+	#pragma omp parallel for reduction(max:densest)
+	for (size_t p = 0; p < size; p++) densest = std::max(densest, density[p]);
+
+	// A log scale keeps both the dense cores and the faint outskirts visible
+	float normalize = densest > 0.f ? 1.f / logf(1.f + densest * exposure) : 0.f;
+	#pragma omp parallel for
+	for (size_t p = 0; p < size; p++) {
+		float v = logf(1.f + density[p] * exposure) * normalize;
+		// Black to red to yellow to white
+		float r = std::clamp(v * 3.f, 0.f, 1.f), g = std::clamp(v * 3.f - 1.f, 0.f, 1.f), b = std::clamp(v * 3.f - 2.f, 0.f, 1.f);
+		pixels[p * 3] = (uint8_t)(r * 255.f);
+		pixels[p * 3 + 1] = (uint8_t)(g * 255.f);
+		pixels[p * 3 + 2] = (uint8_t)(b * 255.f);
+	}
+}
+
+bool splat::Renderer::writePPM(const std::string &path) const {
+	std::ofstream file(path, std::ios::binary);
+	if (!file) return false;
+	file << "P6\n" << width << " " << height << "\n255\n";
+	file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+	return (bool)file;
+}
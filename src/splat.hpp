@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace splat {
+	// Draws bodies on the CPU by adding their mass to a density image, for runs without a GPU
+	class Renderer {
+		public:
+			Renderer(int width, int height);
+
+			// Area of the simulation shown, as its center and half of the height.
+			// The width follows from the aspect ratio of the image
+			float centerX = 0.f, centerY = 0.f, halfHeight = 1.f;
+			// Scales the density before tone mapping. Larger values show fainter regions
+			float exposure = 1.f;
+
+			// Clear the density image
+			void clear();
+			// Add the mass of n bodies to the density image, split between the four closest
+			// pixels. Element i is read from x[i * stride], y[i * stride] and mass[i * stride]
+			// so both separate arrays and interleaved sprites can be drawn
+			void add(const float *x, const float *y, const float *mass, size_t n, int stride=1);
+			// Map the density image to colors with a log scale relative to the densest pixel
+			void toneMap();
+			// Write the last tone mapped image as a binary PPM. Returns false if it can't be written
+			bool writePPM(const std::string &path) const;
+
+			int getWidth() const {
+				return width;
+			}
+			int getHeight() const {
+				return height;
+			}
+			const std::vector<float> &getDensity() const {
+				return density;
+			}
+
+		private:
+			int width, height;
+			std::vector<float> density;
+			// Density images for every thread, summed into density after each add
+			std::vector<std::vector<float>> threadDensity;
+			// RGB bytes from the last tone map
+			std::vector<uint8_t> pixels;
+	};
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <glad/gl.h>
+#include <cstring>
+
+// A buffer that stays mapped for its whole life, split into a ring of regions. Each frame
+// is copied straight into the next region while the GPU may still be drawing from the
+// others, and a fence on every region says when the GPU is done with it. The buffer is
+// freed with the GL context
+class StreamBuffer {
+	public:
+		static constexpr int regions = 3;
+
+		// Make room for size bytes per region. Existing contents are lost
+		void allocate(size_t size) {
+			release();
+			regionSize = size;
+			GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+			glCreateBuffers(1, &buffer);
+			glNamedBufferStorage(buffer, regionSize * regions, nullptr, flags);
+			mapped = static_cast<char*>(glMapNamedBufferRange(buffer, 0, regionSize * regions, flags));
+		}
+
+		// Copy size bytes into the next region once the GPU is done with it. Returns the
+		// offset of the region in the buffer
+		GLintptr write(const void *data, size_t size) {
+			region = (region + 1) % regions;
+			if (fences[region]) {
+				glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				glDeleteSync(fences[region]);
+				fences[region] = nullptr;
+			}
+			std::memcpy(mapped + region * regionSize, data, size);
+			return region * regionSize;
+		}
+
+		// Mark the current region as in use by the commands issued so far
+		void fence() {
+			if (fences[region]) glDeleteSync(fences[region]);
+			fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		}
+
+		GLuint getBuffer() const {
+			return buffer;
+		}
+
+		size_t capacity() const {
+			return regionSize;
+		}
+
+	private:
+		void release() {
+			if (!buffer) return;
+			// The buffer can't be deleted while the GPU might still read it
+			for (GLsync &fence : fences) {
+				if (!fence) continue;
+				glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				glDeleteSync(fence);
+				fence = nullptr;
+			}
+			glUnmapNamedBuffer(buffer);
+			glDeleteBuffers(1, &buffer);
+			buffer = 0;
+			mapped = nullptr;
+		}
+
+		GLuint buffer = 0;
+		char *mapped = nullptr;
+		size_t regionSize = 0;
+		GLsync fences[regions] = {};
+		int region = 0;
+};
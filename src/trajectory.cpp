@@ -0,0 +1,200 @@
+#include "trajectory.hpp"
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	// O_DIRECT needs buffers, sizes and file offsets aligned to the device's blocks
+	constexpr size_t blockSize = 4096;
+	constexpr uint32_t byteOrderMark = 0x01020304;
+	constexpr char magic[8] = { 'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J' };
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t bodySize;
+		uint32_t reserved[11];
+	};
+	static_assert(sizeof(Header) == 64);
+
+	struct FrameHeader {
+		uint64_t step;
+		uint64_t count;
+		// Bytes from the start of this frame to the next one
+		uint64_t size;
+		uint64_t reserved[5];
+	};
+	static_assert(sizeof(FrameHeader) == 64);
+
+	size_t alignToBlock(size_t size) {
+		return (size + blockSize - 1) / blockSize * blockSize;
+	}
+
+	char *allocateBlocks(size_t size) {
+		return static_cast<char*>(::operator new(size, std::align_val_t(blockSize)));
+	}
+
+	void freeBlocks(char *memory) {
+		::operator delete(memory, std::align_val_t(blockSize));
+	}
+}
+
+trajectory::Writer::Writer(const std::string &path, uint64_t interval, Policy policy, int bufferCount, bool direct)
+		: policy(policy), interval(std::max<uint64_t>(interval, 1)) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	// Not every file system supports O_DIRECT, so fall back to the page cache
+	if (direct) {
+		file = open(path.c_str(), flags | O_DIRECT, 0644);
+		this->direct = file >= 0;
+	}
+#endif
+	if (file < 0) file = open(path.c_str(), flags, 0644);
+	if (file < 0) throw std::runtime_error("Can't open " + path + ": " + std::strerror(errno));
+
+	// The file header takes a whole block so frames stay aligned
+	char *header = allocateBlocks(blockSize);
+	std::memset(header, 0, blockSize);
+	Header *fields = reinterpret_cast<Header*>(header);
+	std::memcpy(fields->magic, magic, sizeof(magic));
+	fields->version = version;
+	fields->byteOrder = byteOrderMark;
+	fields->bodySize = sizeof(simulation::Body);
+	bool wrote = write(header, blockSize);
+	freeBlocks(header);
+	if (!wrote) {
+		::close(file);
+		throw std::runtime_error("Can't write " + path + ": " + std::strerror(errno));
+	}
+
+	// Buffers are allocated once they know the number of bodies
+	buffers.resize(std::max(bufferCount, 1));
+	queue.resize(buffers.size());
+	for (int i = (int)buffers.size() - 1; i >= 0; i--) freeBuffers.push_back(i);
+	thread = std::thread(&Writer::run, this);
+}
+
+trajectory::Writer::~Writer() {
+	close();
+	for (Buffer &buffer : buffers) freeBlocks(buffer.memory);
+}
+
+void trajectory::Writer::close() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	ready.notify_one();
+	if (thread.joinable()) thread.join();
+	if (file >= 0) ::close(file);
+	file = -1;
+}
+
+void trajectory::Writer::offer(const simulation::Simulation &sim, uint64_t step) {
+	if (step % interval != 0) return;
+	offered++;
+
+	int index;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (stopping) {
+			dropped++;
+			return;
+		}
+		if (freeBuffers.empty()) {
+			if (policy == Policy::Block) {
+				blocked++;
+				freed.wait(lock, [this]() { return !freeBuffers.empty(); });
+			}
+			else {
+				dropped++;
+				if (policy == Policy::Decimate) {
+					interval = interval * 2;
+					decimated++;
+				}
+				return;
+			}
+		}
+		index = freeBuffers.back();
+		freeBuffers.pop_back();
+	}
+
+	// The buffer belongs to this thread until it is queued, so it's filled without the lock
+	const simulation::BodyStore &bodies = sim.getBodies();
+	size_t count = bodies.size();
+	size_t used = sizeof(FrameHeader) + count * (sizeof(simulation::Body) + sizeof(uint32_t));
+	size_t size = alignToBlock(used);
+	Buffer &buffer = buffers[index];
+	if (size > buffer.capacity) {
+		freeBlocks(buffer.memory);
+		buffer.memory = allocateBlocks(size);
+		buffer.capacity = size;
+	}
+	buffer.size = size;
+
+	FrameHeader *header = reinterpret_cast<FrameHeader*>(buffer.memory);
+	*header = { .step = step, .count = count, .size = size };
+	simulation::Body *out = reinterpret_cast<simulation::Body*>(buffer.memory + sizeof(FrameHeader));
+	#pragma omp parallel for
+	for (size_t i = 0; i < count; i++) out[i] = bodies.get(i);
+	std::memcpy(out + count, bodies.id.data(), count * sizeof(uint32_t));
+	std::memset(buffer.memory + used, 0, size - used);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue[(queueStart + queued) % queue.size()] = index;
+		queued++;
+	}
+	ready.notify_one();
+}
+
+trajectory::Stats trajectory::Writer::getStats() const {
+	Stats stats;
+	stats.offered = offered;
+	stats.written = written;
+	stats.dropped = dropped;
+	stats.blocked = blocked;
+	stats.decimated = decimated;
+	stats.failed = failed;
+	stats.bytes = bytes;
+	stats.interval = interval;
+	return stats;
+}
+
+void trajectory::Writer::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		// Everything queued is written before stopping
+		ready.wait(lock, [this]() { return queued > 0 || stopping; });
+		if (queued == 0) return;
+		int index = queue[queueStart];
+		queueStart = (queueStart + 1) % queue.size();
+		queued--;
+
+		lock.unlock();
+		if (write(buffers[index].memory, buffers[index].size)) written++;
+		lock.lock();
+
+		freeBuffers.push_back(index);
+		freed.notify_one();
+	}
+}
+
+bool trajectory::Writer::write(const char *memory, size_t size) {
+	while (size > 0) {
+		ssize_t count = ::write(file, memory, size);
+		if (count < 0 && errno == EINTR) continue;
+		if (count <= 0) {
+			failed++;
+			return false;
+		}
+		memory += count;
+		size -= count;
+		bytes += count;
+	}
+	return true;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include "simulation.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Trajectories are written as a 4 KiB file header followed by one record per saved step:
+//
+//   Header       magic, version, byte order mark and the size of a body in bytes
+//   Frame        step and number of bodies, then the bodies as simulation::Body structs
+//                (x, y, radius, mass, vx, vy as float32) and the id of every body as a
+//                uint32, padded to a multiple of 4 KiB
+//
+// Bodies are saved in the order of the store, which changes when it's sorted or bodies
+// merge, so bodies are matched across frames by id
+//
+// Every record is a multiple of the block size so the file can be written with O_DIRECT
+namespace trajectory {
+	constexpr uint32_t version = 2;
+
+	// What to do with a step when every buffer is still waiting to be written
+	enum class Policy {
+		// Wait for the writer thread, stalling the simulation
+		Block,
+		// Skip the step
+		Drop,
+		// Skip the step and save every other step from then on
+		Decimate
+	};
+
+	struct Stats {
+		// Steps that were due to be saved, and what happened to them
+		uint64_t offered = 0, written = 0, dropped = 0;
+		// Times the simulation waited for a buffer, and times the interval was doubled
+		uint64_t blocked = 0, decimated = 0;
+		// Writes that failed and bytes written
+		uint64_t failed = 0, bytes = 0;
+		// Steps between saved steps right now
+		uint64_t interval = 0;
+	};
+
+	// Copies every interval-th step into one of a fixed number of buffers and writes the
+	// full buffers from its own thread with one large sequential write each, so the
+	// simulation only pays for the copy
+	class Writer {
+		public:
+			// Throws std::runtime_error if path can't be opened. O_DIRECT is used when direct
+			// is set and the file system supports it
+			Writer(const std::string &path, uint64_t interval=1, Policy policy=Policy::Drop, int buffers=4, bool direct=false);
+			// Calls close
+			~Writer();
+			Writer(const Writer &) = delete;
+			Writer &operator=(const Writer &) = delete;
+
+			// Call after every step. Copies the bodies if step is one to save
+			void offer(const simulation::Simulation &sim, uint64_t step);
+			// Write every queued step, stop the thread and close the file. Steps offered
+			// after this are dropped
+			void close();
+			Stats getStats() const;
+			// True if the file is written with O_DIRECT
+			bool isDirect() const {
+				return direct;
+			}
+
+		private:
+			struct Buffer {
+				char *memory = nullptr;
+				size_t capacity = 0, size = 0;
+			};
+
+			void run();
+			// Write size bytes, returning false if the write failed
+			bool write(const char *memory, size_t size);
+
+			int file = -1;
+			bool direct = false;
+			Policy policy;
+			std::atomic<uint64_t> interval;
+
+			// Buffers not in use, and a ring of buffers waiting to be written
+			std::vector<Buffer> buffers;
+			std::vector<int> freeBuffers;
+			std::vector<int> queue;
+			size_t queueStart = 0, queued = 0;
+			bool stopping = false;
+			std::mutex mutex;
+			// Signalled when a buffer is queued and when one is written
+			std::condition_variable ready, freed;
+			std::thread thread;
+
+			std::atomic<uint64_t> offered = 0, written = 0, dropped = 0, blocked = 0, decimated = 0, failed = 0, bytes = 0;
+	};
+}
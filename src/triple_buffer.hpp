@@ -0,0 +1,40 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Passes the latest value from one writer thread to one reader thread without locks.
+// The writer fills back() and publishes it, the reader takes the newest published value
+// with acquire() and reads it from front(). Neither side ever waits for the other and
+// values published while the reader is busy are skipped
+template<class T>
+class TripleBuffer {
+	public:
+		T& back() {
+			return slots[backIndex];
+		}
+
+		// Swap the back slot with the middle one so the reader can take it
+		void publish() {
+			backIndex = middle.exchange(backIndex | fresh, std::memory_order_acq_rel) & indexMask;
+		}
+
+		// Take the newest published value if there is one. Returns false if front() hasn't changed
+		bool acquire() {
+			if (!(middle.load(std::memory_order_relaxed) & fresh)) return false;
+			frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & indexMask;
+			return true;
+		}
+
+		const T& front() const {
+			return slots[frontIndex];
+		}
+
+	private:
+		// The middle slot's index is kept with a flag that is set while it holds a value
+		// the reader hasn't taken
+		static constexpr uint8_t fresh = 4, indexMask = 3;
+
+		T slots[3];
+		uint8_t backIndex = 0, frontIndex = 1;
+		std::atomic<uint8_t> middle = 2;
+};
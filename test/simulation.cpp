@@ -0,0 +1,616 @@
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <omp.h>
+#include <unistd.h>
+#include "simulation.hpp"
+#include "snapshot.hpp"
+#include "trajectory.hpp"
+
+using namespace simulation;
+using namespace std;
+
+// Acceleration of body i from every other body, summed directly in double precision
+static pair<double, double> directGravity(const BodyStore &bodies, size_t i, float gravity, float softening) {
+	double ax = 0.0, ay = 0.0;
+	for (size_t j = 0; j < bodies.size(); j++) {
+		double dx = bodies.x[j] - bodies.x[i], dy = bodies.y[j] - bodies.y[i];
+		double dist2 = dx * dx + dy * dy;
+		if (j == i || dist2 == 0.0) continue;
+		dist2 += softening;
+		double scale = bodies.mass[j] / (dist2 * sqrt(dist2));
+		ax += dx * scale;
+		ay += dy * scale;
+	}
+	return { gravity * ax, gravity * ay };
+}
+
+// Barnes-Hut should match direct summation at any opening angle people use. A light
+// cluster in one corner and a heavy one in the other makes any node accepted as a point
+// mass while it contains the body being pulled show up as a wrong acceleration
+static int testGravity() {
+	int failures = 0;
+	mt19937 gen(1);
+	uniform_real_distribution<float> unit(0.f, 1.f);
+
+	for (float theta : { 0.5f, 0.9f, 1.f, 1.2f }) {
+		Simulation sim;
+		sim.theta = theta;
+		sim.collide = false;
+		sim.reorderInterval = 0;
+		gen.seed(1);
+		for (int i = 0; i < 80; i++) {
+			bool heavy = i % 2;
+			float corner = heavy ? 0.9f : -0.9f;
+			Body body = { .position = { corner + (unit(gen) - 0.5f) * 0.02f, corner + (unit(gen) - 0.5f) * 0.02f },
+				.radius = 1e-4f, .mass = heavy ? 1.f : 1e-3f, .velocity = { 0.f, 0.f } };
+			sim.addBody(body);
+		}
+		// A step of no time finds the forces without moving anything
+		sim.step(0.f);
+
+		const BodyStore &bodies = sim.getBodies();
+		double worst = 0.0;
+		for (size_t i = 0; i < bodies.size(); i++) {
+			auto exact = directGravity(bodies, i, sim.gravity, sim.softening);
+			double error = hypot(bodies.ax[i] - exact.first, bodies.ay[i] - exact.second) / hypot(exact.first, exact.second);
+			worst = max(worst, error);
+		}
+		if (worst > 0.01) {
+			cout << "Barnes-Hut is off by " << worst * 100.0 << "% at theta " << theta << endl;
+			failures++;
+		}
+	}
+	return failures;
+}
+
+// Overlapping pairs of bodies in a row, each pair well apart from the others
+static void addPairs(Simulation &sim, int pairs, float radius) {
+	for (int i = 0; i < pairs; i++) {
+		float x = -0.9f + 1.8f * i / pairs;
+		Body a = { .position = { x, 0.f }, .radius = radius, .mass = 1.f, .velocity = { 0.01f, 0.f } };
+		Body b = { .position = { x + radius, radius * 0.5f }, .radius = radius, .mass = 2.f, .velocity = { -0.01f, 0.f } };
+		sim.addBody(a);
+		sim.addBody(b);
+	}
+}
+
+// Collisions found by a large team shouldn't be reported again by a smaller one
+static int testCollisionTeams() {
+	int failures = 0;
+	int original = omp_get_max_threads();
+	Simulation sim;
+	sim.reorderInterval = 0;
+	addPairs(sim, 200, 1e-3f);
+	for (int threads : { 4, 1, 3 }) {
+		omp_set_num_threads(threads);
+		sim.step(0.f);
+		if (sim.getCollisions().size() != 200) {
+			cout << "Found " << sim.getCollisions().size() << " collisions instead of 200 on " << threads << " threads" << endl;
+			failures++;
+		}
+	}
+	omp_set_num_threads(original);
+	return failures;
+}
+
+// Random bodies in a square of half size spread. With 10k bodies and a spread of 0.2 most
+// overlap several others, so the same body shows up in many pairs and the pairs need many batches
+static void addCrowd(Simulation &sim, int count, unsigned int seed, float spread=0.2f) {
+	mt19937 gen(seed);
+	uniform_real_distribution<float> unit(-1.f, 1.f);
+	for (int i = 0; i < count; i++) {
+		Body body = { .position = { unit(gen) * spread, unit(gen) * spread }, .radius = 2e-3f * (1.5f + unit(gen)),
+			.mass = 1e-4f, .velocity = { unit(gen) * 0.01f, unit(gen) * 0.01f } };
+		sim.addBody(body);
+	}
+}
+
+// Collisions and the velocities after resolving them should be the same bit for bit on
+// any number of threads
+static int testCollisionThreads() {
+	int failures = 0;
+	int original = omp_get_max_threads();
+	vector<pair<uint32_t, uint32_t>> expectedPairs;
+	vector<float> expectedVelocities;
+	for (int threads : { 1, 4, 3 }) {
+		omp_set_num_threads(threads);
+		Simulation sim;
+		addCrowd(sim, 10000, 2);
+		vector<pair<uint32_t, uint32_t>> pairs;
+		for (int step = 0; step < 3; step++) {
+			sim.step(0.001f);
+			pairs.insert(pairs.end(), sim.getCollisions().begin(), sim.getCollisions().end());
+		}
+		const BodyStore &bodies = sim.getBodies();
+		vector<float> velocities(bodies.vx.begin(), bodies.vx.end());
+		velocities.insert(velocities.end(), bodies.vy.begin(), bodies.vy.end());
+
+		if (threads == 1) {
+			expectedPairs = pairs;
+			expectedVelocities = velocities;
+			if (pairs.size() < 10000) {
+				cout << "Only " << pairs.size() << " collisions in the crowd" << endl;
+				failures++;
+			}
+			continue;
+		}
+		if (pairs != expectedPairs) {
+			cout << "Different collisions on " << threads << " threads" << endl;
+			failures++;
+		}
+		if (velocities.size() != expectedVelocities.size()
+				|| memcmp(velocities.data(), expectedVelocities.data(), velocities.size() * sizeof(float)) != 0) {
+			cout << "Different velocities after collisions on " << threads << " threads" << endl;
+			failures++;
+		}
+	}
+	omp_set_num_threads(original);
+	return failures;
+}
+
+// Totals of the store in double precision: mass, momentum along x and y, and area over pi
+static vector<double> totals(const BodyStore &bodies) {
+	vector<double> sums(4, 0.0);
+	for (size_t i = 0; i < bodies.size(); i++) {
+		sums[0] += bodies.mass[i];
+		sums[1] += (double)bodies.mass[i] * bodies.vx[i];
+		sums[2] += (double)bodies.mass[i] * bodies.vy[i];
+		sums[3] += (double)bodies.radius[i] * bodies.radius[i];
+	}
+	return sums;
+}
+
+// Merging should keep the total mass, momentum and area and leave one body per group
+static int testMerge() {
+	int failures = 0;
+	Simulation sim;
+	sim.collisionMode = CollisionMode::Merge;
+	// Sparse enough that the groups stay small, one group of every body would add up
+	// the float rounding of thousands of merges
+	addCrowd(sim, 10000, 3, 0.6f);
+	vector<double> before = totals(sim.getBodies());
+	size_t count = sim.getBodies().size();
+	// A step of no time only merges
+	sim.step(0.f);
+	const BodyStore &bodies = sim.getBodies();
+	vector<double> after = totals(bodies);
+
+	// Every body in a pair except the lowest id of its group is removed
+	vector<uint32_t> group(count);
+	for (uint32_t i = 0; i < count; i++) group[i] = i;
+	auto find = [&](uint32_t i) {
+		while (group[i] != i) i = group[i] = group[group[i]];
+		return i;
+	};
+	for (auto &pair : sim.getCollisions()) {
+		uint32_t a = find(pair.first), b = find(pair.second);
+		group[max(a, b)] = min(a, b);
+	}
+	size_t groups = 0;
+	for (uint32_t i = 0; i < count; i++) groups += find(i) == i;
+
+	if (sim.getCollisions().empty()) {
+		cout << "Nothing merged in the crowd" << endl;
+		failures++;
+	}
+	if (bodies.size() != groups || bodies.vx.size() != groups || bodies.radius.size() != groups || bodies.ax.size() != groups || bodies.rung.size() != groups) {
+		cout << "Merged into " << bodies.size() << " bodies instead of " << groups << endl;
+		failures++;
+	}
+	// Survivors keep their ids, so every id is still one of the original ones and unique
+	vector<bool> seen(count);
+	for (uint32_t id : bodies.id) {
+		if (id >= count || seen[id]) {
+			cout << "Merging left a body with id " << id << endl;
+			failures++;
+			break;
+		}
+		seen[id] = true;
+	}
+	const char *names[] = { "mass", "momentum x", "momentum y", "area" };
+	double scales[] = { before[0], before[0] * 0.01, before[0] * 0.01, before[3] };
+	for (int i = 0; i < 4; i++) {
+		if (fabs(after[i] - before[i]) > 1e-5 * scales[i]) {
+			cout << "Merging changed the " << names[i] << " from " << before[i] << " to " << after[i] << endl;
+			failures++;
+		}
+	}
+	return failures;
+}
+
+// Energy of the bodies with the same softened potential the forces come from
+static double energy(const Simulation &sim) {
+	const BodyStore &bodies = sim.getBodies();
+	double total = 0.0;
+	for (size_t i = 0; i < bodies.size(); i++) {
+		total += 0.5 * bodies.mass[i] * ((double)bodies.vx[i] * bodies.vx[i] + (double)bodies.vy[i] * bodies.vy[i]);
+		for (size_t j = i + 1; j < bodies.size(); j++) {
+			double dx = bodies.x[j] - bodies.x[i], dy = bodies.y[j] - bodies.y[i];
+			total -= sim.gravity * bodies.mass[i] * bodies.mass[j] / sqrt(dx * dx + dy * dy + sim.softening);
+		}
+	}
+	return total;
+}
+
+// Largest relative energy error over about one orbit of an eccentric binary with a light
+// third body, with exact forces
+static double energyError(Integrator integrator, int steps) {
+	Simulation sim;
+	sim.theta = 0.f;
+	sim.gravity = 1.f;
+	sim.collide = false;
+	sim.integrator = integrator;
+	Body bodies[] = {
+		{ .position = { 0.375f, 0.f }, .radius = 1e-3f, .mass = 0.5f, .velocity = { 0.f, 0.408f } },
+		{ .position = { -0.375f, 0.f }, .radius = 1e-3f, .mass = 0.5f, .velocity = { 0.f, -0.408f } },
+		{ .position = { 0.f, 0.9f }, .radius = 1e-3f, .mass = 0.01f, .velocity = { -1.f, 0.f } }
+	};
+	for (Body &body : bodies) sim.addBody(body);
+
+	double start = energy(sim), worst = 0.0;
+	for (int i = 0; i < steps; i++) {
+		sim.step(2.2f / steps);
+		worst = max(worst, fabs(energy(sim) - start));
+	}
+	return worst / fabs(start);
+}
+
+// Halving the step should cut the energy error by about 2 for Euler, 4 for leapfrog and
+// 16 for Yoshida. Euler stays the default
+static int testIntegrators() {
+	int failures = 0;
+	struct Order {
+		Integrator integrator;
+		const char *name;
+		double low, high;
+	};
+	for (Order order : { Order{ Integrator::Euler, "Euler", 0.7, 1.3 }, Order{ Integrator::Leapfrog, "leapfrog", 1.7, 2.4 },
+			Order{ Integrator::Yoshida, "Yoshida", 3.3, 4.7 } }) {
+		double measured = log2(energyError(order.integrator, 64) / energyError(order.integrator, 128));
+		if (measured < order.low || measured > order.high) {
+			cout << order.name << " converges at order " << measured << endl;
+			failures++;
+		}
+	}
+
+	Simulation plain, euler;
+	euler.integrator = Integrator::Euler;
+	addCrowd(plain, 200, 7, 0.9f);
+	addCrowd(euler, 200, 7, 0.9f);
+	for (int i = 0; i < 3; i++) {
+		plain.step(0.01f);
+		euler.step(0.01f);
+	}
+	if (plain.integrator != Integrator::Euler
+			|| memcmp(plain.getBodies().x.data(), euler.getBodies().x.data(), 200 * sizeof(float)) != 0
+			|| memcmp(plain.getBodies().vx.data(), euler.getBodies().vx.data(), 200 * sizeof(float)) != 0) {
+		cout << "Euler isn't the default integrator" << endl;
+		failures++;
+	}
+	return failures;
+}
+
+// Block timesteps should stay defined at the edges of their settings
+static int testBlockLimits() {
+	int failures = 0;
+
+	// Without softening every timestep comes out as zero, which takes the smallest step
+	Simulation sim;
+	sim.integrator = Integrator::Leapfrog;
+	sim.blockTimesteps = true;
+	sim.softening = 0.f;
+	sim.maxRung = 4;
+	sim.collide = false;
+	addCrowd(sim, 100, 4, 0.9f);
+	sim.step(0.01f);
+	for (size_t i = 0; i < sim.getBodies().size(); i++) {
+		if (sim.getBodies().rung[i] != 4 || !isfinite(sim.getBodies().x[i]) || !isfinite(sim.getBodies().vx[i])) {
+			cout << "Body " << i << " is on rung " << (int)sim.getBodies().rung[i] << " without softening" << endl;
+			failures++;
+			break;
+		}
+	}
+
+	// Ticks are counted in 32 bits. A lone body feels nothing and takes the whole step
+	Simulation lone;
+	lone.integrator = Integrator::Leapfrog;
+	lone.blockTimesteps = true;
+	lone.maxRung = 40;
+	addCrowd(lone, 1, 5);
+	lone.step(0.01f);
+	if (lone.maxRung != 31 || lone.getBodies().rung[0] != 0) {
+		cout << "maxRung of 40 became " << lone.maxRung << " with the lone body on rung " << (int)lone.getBodies().rung[0] << endl;
+		failures++;
+	}
+	return failures;
+}
+
+static vector<char> readFile(const string &path) {
+	ifstream file(path, ios::binary);
+	return vector<char>(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+static void writeFile(const string &path, const vector<char> &bytes) {
+	ofstream file(path, ios::binary | ios::trunc);
+	file.write(bytes.data(), bytes.size());
+}
+
+// Loading should fail with an exception for a file that isn't a valid snapshot
+static bool rejects(const string &path, const vector<char> &bytes) {
+	writeFile(path, bytes);
+	try {
+		snapshot::load(path);
+	}
+	catch (const runtime_error &) {
+		return true;
+	}
+	return false;
+}
+
+// Snapshots should load back exactly as saved, reject files they can't use and skip
+// columns they don't know
+static int testSnapshot() {
+	int failures = 0;
+	const string path = "snapshot_test.snap", broken = "snapshot_test_broken.snap";
+	Simulation sim;
+	addCrowd(sim, 5000, 6);
+	const BodyStore &saved = sim.getBodies();
+	snapshot::save(path, saved);
+
+	auto matches = [](const BodyStore &loaded, const BodyStore &saved) {
+		if (loaded.size() != saved.size() || loaded.ax.size() != saved.size() || loaded.rung.size() != saved.size()) return false;
+		for (auto array : { &BodyStore::x, &BodyStore::y, &BodyStore::vx, &BodyStore::vy, &BodyStore::mass, &BodyStore::radius }) {
+			if (memcmp((loaded.*array).data(), (saved.*array).data(), saved.size() * sizeof(float)) != 0) return false;
+		}
+		return true;
+	};
+
+	BodyStore loaded = snapshot::load(path);
+	if (!matches(loaded, saved) || !loaded.x.borrowed()) {
+		cout << "Snapshot didn't load back as saved" << endl;
+		failures++;
+	}
+
+	// Offsets into the 64 byte header and the first 32 byte column of the table
+	const size_t magicAt = 0, versionAt = 8, byteOrderAt = 12, columnsAt = 24, table = 64, columnOffsetAt = 24;
+	vector<char> bytes = readFile(path);
+	auto field = [](vector<char> &file, size_t at, auto value) {
+		memcpy(file.data() + at, &value, sizeof(value));
+		return file;
+	};
+	vector<char> copy;
+
+	copy = bytes;
+	copy[magicAt] = 'X';
+	if (!rejects(broken, copy)) {
+		cout << "Snapshot with a bad magic loaded" << endl;
+		failures++;
+	}
+	copy = bytes;
+	if (!rejects(broken, field(copy, versionAt, snapshot::version + 1))) {
+		cout << "Snapshot with a newer version loaded" << endl;
+		failures++;
+	}
+	copy = bytes;
+	if (!rejects(broken, field(copy, byteOrderAt, (uint32_t)0x04030201))) {
+		cout << "Snapshot with the other byte order loaded" << endl;
+		failures++;
+	}
+	copy = vector<char>(bytes.begin(), bytes.end() - 4096);
+	if (!rejects(broken, copy)) {
+		cout << "Truncated snapshot loaded" << endl;
+		failures++;
+	}
+	copy = vector<char>(bytes.begin(), bytes.begin() + 40);
+	if (!rejects(broken, copy)) {
+		cout << "Snapshot without a full header loaded" << endl;
+		failures++;
+	}
+	copy = bytes;
+	uint64_t firstOffset;
+	memcpy(&firstOffset, bytes.data() + table + columnOffsetAt, sizeof(firstOffset));
+	if (!rejects(broken, field(copy, table + columnOffsetAt, firstOffset + 4))) {
+		cout << "Snapshot with an unaligned column loaded" << endl;
+		failures++;
+	}
+
+	// Add a seventh column after the six known ones. The table has room for it before
+	// the first page of data
+	copy = bytes;
+	uint32_t columns;
+	memcpy(&columns, bytes.data() + columnsAt, sizeof(columns));
+	field(copy, columnsAt, columns + 1);
+	char extra[32] = "spin";
+	uint32_t type = 1;
+	uint64_t offset = copy.size();
+	memcpy(extra + 16, &type, sizeof(type));
+	memcpy(extra + 24, &offset, sizeof(offset));
+	memcpy(copy.data() + table + columns * 32, extra, sizeof(extra));
+	copy.resize(copy.size() + (saved.size() * sizeof(float) + 4095) / 4096 * 4096, 0);
+	writeFile(broken, copy);
+	try {
+		if (!matches(snapshot::load(broken), saved)) {
+			cout << "Snapshot with an unknown column loaded wrong" << endl;
+			failures++;
+		}
+	}
+	catch (const runtime_error &e) {
+		cout << "Snapshot with an unknown column didn't load: " << e.what() << endl;
+		failures++;
+	}
+
+	// A store borrowing from a file should save back over that file, before and after it
+	// has stepped
+	for (int steps : { 0, 2 }) {
+		Simulation reloaded;
+		reloaded.setBodies(snapshot::load(path));
+		const float *mapped = reloaded.getBodies().mass.data();
+		for (int i = 0; i < steps; i++) reloaded.step(0.001f);
+		// Nothing writes to the masses, so unless the bodies were sorted they're still mapped
+		if (reloaded.getBodies().mass.data() != mapped) {
+			cout << "Loaded snapshot was sorted after " << steps << " steps" << endl;
+			failures++;
+		}
+		snapshot::save(path, reloaded.getBodies());
+		if (!matches(snapshot::load(path), reloaded.getBodies())) {
+			cout << "Snapshot saved over its own file after " << steps << " steps didn't load back" << endl;
+			failures++;
+		}
+	}
+
+	remove(path.c_str());
+	remove(broken.c_str());
+	return failures;
+}
+
+// A saved step of a trajectory file
+struct Frame {
+	uint64_t step;
+	vector<Body> bodies;
+	vector<uint32_t> ids;
+};
+
+// Parse a trajectory file into frames, returning false if it isn't laid out as documented
+static bool parseTrajectory(const vector<char> &bytes, vector<Frame> &frames) {
+	const size_t block = 4096, frameHeader = 64;
+	uint32_t version, bodySize;
+	if (bytes.size() < block || memcmp(bytes.data(), "NBODYTRJ", 8) != 0) return false;
+	memcpy(&version, bytes.data() + 8, sizeof(version));
+	memcpy(&bodySize, bytes.data() + 16, sizeof(bodySize));
+	if (version != trajectory::version || bodySize != sizeof(Body)) return false;
+
+	for (size_t offset = block; offset < bytes.size();) {
+		uint64_t fields[3];
+		if (bytes.size() - offset < frameHeader) return false;
+		memcpy(fields, bytes.data() + offset, sizeof(fields));
+		uint64_t count = fields[1], size = fields[2];
+		if (size % block != 0 || size > bytes.size() - offset || size < frameHeader + count * (sizeof(Body) + sizeof(uint32_t))) return false;
+
+		Frame frame = { .step = fields[0], .bodies = vector<Body>(count), .ids = vector<uint32_t>(count) };
+		const char *data = bytes.data() + offset + frameHeader;
+		memcpy(frame.bodies.data(), data, count * sizeof(Body));
+		memcpy(frame.ids.data(), data + count * sizeof(Body), count * sizeof(uint32_t));
+		frames.push_back(move(frame));
+		offset += size;
+	}
+	return true;
+}
+
+// Fill every buffer of a writer with a full pipe behind it, so the writer thread is stuck
+// until the pipe is read, and check what each policy does with the steps after that
+static int testTrajectory() {
+	int failures = 0;
+	struct Expected {
+		trajectory::Policy policy;
+		const char *name;
+		uint64_t dropped, decimated, blocked, interval;
+		vector<uint64_t> steps;
+	};
+	Expected cases[] = {
+		{ trajectory::Policy::Drop, "drop", 3, 0, 0, 1, { 0, 1 } },
+		// Step 2 is dropped and doubles the interval, so 3 isn't due and 4 is dropped again
+		{ trajectory::Policy::Decimate, "decimate", 2, 2, 0, 4, { 0, 1 } },
+		{ trajectory::Policy::Block, "block", 0, 0, 1, 1, { 0, 1, 2 } }
+	};
+
+	for (const Expected &expected : cases) {
+		Simulation sim;
+		sim.collide = false;
+		sim.reorderInterval = 1;
+		// A frame is much larger than a pipe holds, so the first write can't finish
+		addCrowd(sim, 20000, 5, 0.6f);
+		vector<Body> added(sim.getBodies().size());
+		for (size_t i = 0; i < added.size(); i++) added[i] = sim.getBodies().get(i);
+
+		int ends[2];
+		if (pipe(ends) != 0) {
+			cout << "Can't make a pipe for the trajectory test" << endl;
+			return failures + 1;
+		}
+		vector<char> bytes;
+		thread reader;
+		auto read = [&]() {
+			reader = thread([&]() {
+				char chunk[65536];
+				ssize_t count;
+				while ((count = ::read(ends[0], chunk, sizeof(chunk))) > 0) bytes.insert(bytes.end(), chunk, chunk + count);
+			});
+		};
+
+		trajectory::Writer writer("/dev/fd/" + to_string(ends[1]), 1, expected.policy, 2);
+		// The writer has its own descriptor for the pipe, so the reader sees the end once it closes
+		close(ends[1]);
+
+		// The first step is saved in the order the bodies were added and the second after
+		// they were sorted. A step of no time doesn't move them
+		writer.offer(sim, 0);
+		sim.step(0.f);
+		writer.offer(sim, 1);
+		if (expected.policy == trajectory::Policy::Block) {
+			thread blocked([&]() { writer.offer(sim, 2); });
+			while (writer.getStats().blocked == 0) this_thread::sleep_for(chrono::milliseconds(1));
+			read();
+			blocked.join();
+		}
+		else {
+			for (uint64_t step = 2; step <= 4; step++) writer.offer(sim, step);
+			read();
+		}
+		writer.close();
+		reader.join();
+		close(ends[0]);
+
+		trajectory::Stats stats = writer.getStats();
+		if (stats.dropped != expected.dropped || stats.decimated != expected.decimated || stats.blocked != expected.blocked
+				|| stats.interval != expected.interval || stats.written != expected.steps.size() || stats.failed != 0) {
+			cout << "Trajectory writer with the " << expected.name << " policy wrote " << stats.written << ", dropped " << stats.dropped
+				<< ", decimated " << stats.decimated << " and blocked " << stats.blocked << " times" << endl;
+			failures++;
+		}
+
+		vector<Frame> frames;
+		if (!parseTrajectory(bytes, frames) || frames.size() != expected.steps.size()) {
+			cout << "Trajectory written with the " << expected.name << " policy didn't parse back" << endl;
+			failures++;
+			continue;
+		}
+		for (size_t i = 0; i < frames.size(); i++) {
+			// Every id should lead back to the body it was given to
+			bool matches = frames[i].step == expected.steps[i] && frames[i].bodies.size() == added.size();
+			for (size_t j = 0; matches && j < frames[i].ids.size(); j++) {
+				uint32_t id = frames[i].ids[j];
+				matches = id < added.size() && memcmp(&frames[i].bodies[j], &added[id], sizeof(Body)) == 0;
+			}
+			if (!matches) {
+				cout << "Frame " << i << " written with the " << expected.name << " policy doesn't match the bodies by id" << endl;
+				failures++;
+			}
+		}
+		if (frames[1].ids == frames[0].ids) {
+			cout << "Bodies weren't sorted between frames, so ids weren't tested" << endl;
+			failures++;
+		}
+	}
+	return failures;
+}
+
+int main() {
+	int failures = 0;
+	failures += testGravity();
+	failures += testCollisionTeams();
+	failures += testCollisionThreads();
+	failures += testMerge();
+	failures += testIntegrators();
+	failures += testBlockLimits();
+	failures += testSnapshot();
+	failures += testTrajectory();
+
+	if (failures == 0) cout << "All simulation checks passed" << endl;
+	return failures > 0;
+}